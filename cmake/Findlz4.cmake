@@ -0,0 +1,16 @@
+# LZ4_FOUND - system has the lz4 library
+# LZ4_INCLUDE_DIR - the lz4 include directory
+# LZ4_LIBRARIES - The libraries needed to use lz4
+
+if(LZ4_INCLUDE_DIR AND LZ4_LIBRARIES)
+  set(LZ4_FOUND TRUE)
+else(LZ4_INCLUDE_DIR AND LZ4_LIBRARIES)
+
+  find_path(LZ4_INCLUDE_DIR NAMES lz4.h)
+  find_library(LZ4_LIBRARIES NAMES lz4 liblz4)
+
+  include(FindPackageHandleStandardArgs)
+  find_package_handle_standard_args(lz4 DEFAULT_MSG LZ4_INCLUDE_DIR LZ4_LIBRARIES)
+
+  mark_as_advanced(LZ4_INCLUDE_DIR LZ4_LIBRARIES)
+endif(LZ4_INCLUDE_DIR AND LZ4_LIBRARIES)
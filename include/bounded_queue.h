@@ -0,0 +1,55 @@
+/*! \file */
+#ifndef _BOUNDED_QUEUE_H
+#define _BOUNDED_QUEUE_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+/**
+ *\brief A fixed-capacity FIFO queue for handing work between threads
+ *
+ * push() waits while the queue is full, so a fast producer can only get
+ * a limited distance ahead of its consumers. pop() waits for an item,
+ * and returns false once the queue has been closed and emptied.
+ */
+template<typename T>
+class BoundedQueue {
+public:
+	BoundedQueue(std::size_t capacity)
+		: capacity(capacity), closed(false)
+	{ }
+
+	void push(T item) {
+		std::unique_lock<std::mutex> lock(mutex);
+		notFull.wait(lock, [&]() { return items.size() < capacity; });
+		items.push_back(std::move(item));
+		notEmpty.notify_one();
+	}
+
+	bool pop(T &item) {
+		std::unique_lock<std::mutex> lock(mutex);
+		notEmpty.wait(lock, [&]() { return !items.empty() || closed; });
+		if (items.empty()) return false;
+		item = std::move(items.front());
+		items.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+
+	// No more items will be pushed; wake any waiting consumers
+	void close() {
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		notEmpty.notify_all();
+	}
+
+private:
+	std::mutex mutex;
+	std::condition_variable notFull, notEmpty;
+	std::deque<T> items;
+	std::size_t capacity;
+	bool closed;
+};
+
+#endif //_BOUNDED_QUEUE_H
@@ -77,6 +77,11 @@ constexpr double MinLat = -MaxLat;
 double lat2latp(double lat);
 double latp2lat(double latp);
 
+// Project a run of delta-coded coordinates in 1e-7 degrees (a DenseNodes group, or a
+// way's LocationsOnWays) into LatpLon, writing count values to out. Interpolates rather
+// than calling lat2latp, and may differ from it by one unit in the last place.
+void projectDeltaCoordinates(int64_t const *latDeltas, int64_t const *lonDeltas, std::size_t count, LatpLon *out);
+
 // Tile conversions
 double lon2tilexf(double lon, uint z);
 double latp2tileyf(double latp, uint z);
@@ -27,7 +27,34 @@ inline std::vector<std::string> split_string(std::string &inputStr, char sep) {
 	return res;
 }
 
+/**
+ *\brief Reusable zlib streams
+ *
+ * Setting up a z_stream allocates its window and state, so each thread keeps one
+ * of these (forThread) and resets the streams between uses instead. Output goes
+ * into a caller-supplied string, so callers can reuse its storage too.
+ */
+class ZlibContext {
+public:
+	ZlibContext();
+	~ZlibContext();
+	ZlibContext(ZlibContext const &) = delete;
+	ZlibContext &operator=(ZlibContext const &) = delete;
+
+	static ZlibContext &forThread();
+
+	void decompress(const char *data, std::size_t size, std::string &out, bool asGzip = false, std::size_t expectedSize = 0);
+	void compress(const char *data, std::size_t size, std::string &out, int compressionlevel = Z_DEFAULT_COMPRESSION, bool asGzip = false);
+
+private:
+	z_stream inflater, gzipInflater, deflater;
+	bool inflaterInited, gzipInflaterInited, deflaterInited;
+	int deflateLevel;
+	bool deflateGzip;
+};
+
 std::string decompress_string(const std::string& str, bool asGzip = false);
+std::string decompress_string(const char *data, std::size_t size, bool asGzip = false);
 
 std::string compress_string(const std::string& str,
                             int compressionlevel = Z_DEFAULT_COMPRESSION,
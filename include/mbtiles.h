@@ -2,6 +2,7 @@
 #ifndef _MBTILES_H
 #define _MBTILES_H
 
+#include <functional>
 #include <string>
 #include <mutex>
 #include <vector>
@@ -27,7 +28,8 @@ public:
 	void openForReading(std::string *filename);
 	void readBoundingBox(double &minLon, double &maxLon, double &minLat, double &maxLat);
 	void readTileList(std::vector<std::tuple<int,int,int>> &tileList);
-	std::vector<char> readTile(int zoom, int col, int row);
+	// Pass a tile to process without copying it; the data is only valid during the call
+	void readTile(int zoom, int col, int row, std::function<void(char const *data, std::size_t size)> const &process);
 	bool readTileAndUncompress(std::string &data, int zoom, int col, int row, bool isCompressed, bool asGzip);
 };
 
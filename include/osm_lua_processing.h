@@ -6,6 +6,7 @@
 #include <string>
 #include <sstream>
 #include <map>
+#include <unordered_map>
 #include "geom.h"
 #include "osm_store.h"
 #include "shared_data.h"
@@ -14,6 +15,7 @@
 #include "osm_mem_tiles.h"
 #include "attribute_store.h"
 #include "helpers.h"
+#include "tag_list.h"
 
 #include <boost/container/flat_map.hpp>
 
@@ -66,22 +68,20 @@ public:
 
 	// ----	Data loading methods
 
-	using tag_map_t = boost::container::flat_map<std::string, std::string>;
-
 	// Scan non-MP relation
-	bool scanRelation(WayID id, const tag_map_t &tags);
+	bool scanRelation(WayID id, const TagList &tags);
 
 	/// \brief We are now processing a significant node
-	void setNode(NodeID id, LatpLon node, const tag_map_t &tags);
+	void setNode(NodeID id, LatpLon node, const TagList &tags);
 
 	/// \brief We are now processing a way
-	void setWay(WayID wayId, LatpLonVec const &llVec, const tag_map_t &tags);
+	void setWay(WayID wayId, LatpLonVec const &llVec, const TagList &tags);
 
 	/** \brief We are now processing a relation
 	 * (note that we store relations as ways with artificial IDs, and that
 	 *  we use decrementing positive IDs to give a bit more space for way IDs)
 	 */
-	void setRelation(int64_t relationId, WayVec const &outerWayVec, WayVec const &innerWayVec, const tag_map_t &tags, bool isNativeMP);
+	void setRelation(int64_t relationId, WayVec const &outerWayVec, WayVec const &innerWayVec, const TagList &tags, bool isNativeMP);
 
 	// ----	Metadata queries called from Lua
 
@@ -181,6 +181,8 @@ public:
 	void setVectorLayerMetadata(const uint_least8_t layer, const std::string &key, const uint type);
 
 	std::vector<std::string> GetSignificantNodeKeys();
+	std::vector<std::string> GetSignificantWayKeys();
+	std::vector<std::string> GetSignificantRelationKeys();
 
 	// ---- Cached geometries creation
 
@@ -196,18 +198,7 @@ public:
 
 private:
 	/// Internal: clear current cached state
-	inline void reset() {
-		outputs.clear();
-		llVecPtr = nullptr;
-		outerWayVecPtr = nullptr;
-		innerWayVecPtr = nullptr;
-		linestringInited = false;
-		multiLinestringInited = false;
-		polygonInited = false;
-		multiPolygonInited = false;
-		relationAccepted = false;
-		relationSubscript = -1;
-	}
+	void reset();
 
 	const inline Point getPoint() {
 		return Point(lon/10000000.0,latp/10000000.0);
@@ -228,7 +219,7 @@ private:
 	bool isWay, isRelation, isClosed;		///< Way, node, relation?
 
 	bool relationAccepted;					// in scanRelation, whether we're using a non-MP relation
-	std::vector<WayID> relationList;		// in processWay, list of relations this way is in
+	RelationScanStore::relation_list_t relationList;	// in processWay, list of relations this way is in
 	int relationSubscript = -1;				// in processWay, position in the relation list
 
 	int32_t lon,latp;						///< Node coordinates
@@ -249,7 +240,10 @@ private:
 	class LayerDefinition &layers;
 	
 	std::deque<std::pair<OutputObjectRef, AttributeStoreRef>> outputs;			///< All output objects that have been created
-	boost::container::flat_map<std::string, std::string> currentTags;
+	TagList const *currentTags;				///< Tags of the current object (owned by the reader)
+	mutable std::unordered_map<std::string, uint32_t> keyIds;	///< Interned IDs of keys asked for by Lua
+
+	uint32_t keyId(const std::string &key) const;
 
 };
 
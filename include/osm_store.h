@@ -4,27 +4,72 @@
 
 #include "geom.h"
 #include "coordinates.h"
+#include "tag_list.h"
 
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <cmath>
+#include <deque>
 #include <utility>
 #include <vector>
 #include <mutex>
+#include <unordered_map>
 #include <unordered_set>
 #include <boost/container/flat_map.hpp>
+#include <boost/sort/sort.hpp>
 
 extern bool verbose;
 
+// Store memory comes from large mapped chunks, anonymous or (with --store) file-backed.
+// Each thread bump-allocates from its own chunk without locking. Freed blocks go on the
+// freeing thread's lists, by size, for reuse; blocks too large for a chunk get a mapping
+// of their own. Each arena can also be released all at once, keeping its chunks for reuse.
 class void_mmap_allocator
 {
 public:
     typedef std::size_t size_type;
 
-    static void *allocate(size_type n, const void *hint = 0);
-    static void deallocate(void *p, size_type n);
-    static void destroy(void *p);
-	static void shutdown();
+	enum Arena : unsigned int {
+		StoreArena,			///< nodes, ways and relations; released when the store is cleared
+		GeneratedArena,		///< generated geometries, which are kept until tiles are written
+		ArenaCount
+	};
+
+	// Pages used for anonymous chunks
+	enum class PageMode {
+		Normal,
+		Transparent,	///< ask for transparent huge pages with madvise
+		HugeTLB			///< map from the reserved huge page pool, falling back to transparent huge pages
+	};
+
+	// How the store files are expected to be accessed
+	enum class Access { Sequential, Random };
+
+    static void *allocate(size_type n, Arena arena = StoreArena);
+    static void deallocate(void *p, size_type n, Arena arena = StoreArena);
+
+	// @brief Free everything allocated from an arena; none of it may be used afterwards
+	static void release(Arena arena);
+
+	// @brief Back later allocations with files in this directory; memory already handed out stays where it is
+	static void openStore(std::string const &dir);
+
+	// @brief Set the pages used for chunks mapped from now on
+	static void usePages(PageMode mode);
+	// @brief Turn madvise access hints for store files on or off
+	static void useAccessHints(bool hints);
+	// @brief Hint how store files (existing, and mapped from now on) will be accessed
+	static void advise(Access access);
+
+	// @brief Bytes of store files mapped so far
+	static std::size_t storeFileSize();
+	// @brief Bytes of anonymous memory mapped so far, and how much of it asked for huge pages
+	static std::size_t memorySize();
+	static std::size_t hugePageSize();
 };
 
-template<typename T>
+template<typename T, void_mmap_allocator::Arena A = void_mmap_allocator::StoreArena>
 class mmap_allocator
 {
 
@@ -39,7 +84,7 @@ public:
     template <class U>
     struct rebind
     {
-        typedef mmap_allocator<U> other;
+        typedef mmap_allocator<U, A> other;
     };
     
     mmap_allocator() = default;
@@ -50,91 +95,212 @@ public:
     
     pointer allocate(size_type n, const void *hint = 0)
     {
-		return reinterpret_cast<T *>(void_mmap_allocator::allocate(n * sizeof(T), hint));
+		return reinterpret_cast<T *>(void_mmap_allocator::allocate(n * sizeof(T), A));
     }
 
     void deallocate(pointer p, size_type n)
     {
-		void_mmap_allocator::deallocate(p, n);
+		void_mmap_allocator::deallocate(p, n * sizeof(T), A);
     }
 
-    void construct(pointer p, const_reference val)
+    template<typename U, typename... Args>
+    void construct(U *p, Args&&... args)
     {
-        new((void *)p) T(val);        
+        new((void *)p) U(std::forward<Args>(args)...);
     }
 
-    void destroy(pointer p) { void_mmap_allocator::destroy(p); }
+    template<typename U>
+    void destroy(U *p) { p->~U(); }
 };
 
-template<typename T1, typename T2>
-static inline bool operator==(mmap_allocator<T1> &, mmap_allocator<T2> &) { return true; }
-template<typename T1, typename T2>
-static inline bool operator!=(mmap_allocator<T1> &, mmap_allocator<T2> &) { return false; }
+template<typename T1, typename T2, void_mmap_allocator::Arena A>
+static inline bool operator==(mmap_allocator<T1, A> &, mmap_allocator<T2, A> &) { return true; }
+template<typename T1, typename T2, void_mmap_allocator::Arena A>
+static inline bool operator!=(mmap_allocator<T1, A> &, mmap_allocator<T2, A> &) { return false; }
+
+// Generated geometries outlive the store they were built from
+template<typename T>
+using generated_allocator = mmap_allocator<T, void_mmap_allocator::GeneratedArena>;
 
 //
 // Internal data structures.
 //
-class NodeStore
+
+// Varint and zigzag coding, used by the compressed node and way stores
+inline uint64_t readVarint(uint8_t const *&ptr) {
+	uint64_t result = 0;
+	for (unsigned int shift = 0; ; shift += 7) {
+		uint8_t byte = *ptr++;
+		result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) return result;
+	}
+}
+
+inline uint64_t zigzag(int64_t value) { return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63); }
+inline int64_t unzigzag(uint64_t value) { return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1); }
+
+// NodeStore, WayStore and RelationStore take their elements in per-block segments.
+// Each reading thread appends to the segment for the block it's reading, so inserts
+// need no lock. Once a phase is done, sort() orders the store: for a .pbf with
+// Sort.Type_then_ID the segments are already in ID order when taken in block order,
+// so nothing needs sorting; otherwise they're concatenated and sorted.
+// sort() also freezes the store: from then on it is read-only until reset, so
+// lookups from any number of threads need no lock.
+template<typename T>
+class SegmentedStore
 {
 
 public:
-	using element_t = std::pair<NodeID, LatpLon>;
-	using map_t = std::deque<element_t, mmap_allocator<element_t>>;
+	using element_t = T;
+	using segment_t = std::vector<element_t, mmap_allocator<element_t>>;
 
-	void reopen()
-	{
+	// @brief Make the store empty, with one segment for each of count blocks
+	void reset(std::size_t count) {
 		std::lock_guard<std::mutex> lock(mutex);
-		mLatpLons = std::make_unique<map_t>();
+		segments.clear();
+		segments.resize(std::max<std::size_t>(count, 1));
+		firstIds.clear();
+		frozen = false;
+	}
+
+	// @brief Append elements to a segment; each segment must only be written by one thread at a time
+	void append(std::size_t segment, std::vector<element_t> &elements) {
+		if (frozen) throw std::logic_error("Can't insert into a store once it has been sorted");
+		auto &dst = segments.at(segment);
+		auto i = dst.size();
+		dst.resize(i + elements.size());
+		std::move(elements.begin(), elements.end(), dst.begin() + i);
+	}
+
+	// @brief Append to the last segment, from any thread
+	void append(std::vector<element_t> &elements) {
+		std::lock_guard<std::mutex> lock(mutex);
+		append(segments.size() - 1, elements);
+	}
+
+	std::size_t size() const {
+		std::size_t total = 0;
+		for (auto const &segment : segments) total += segment.size();
+		return total;
 	}
 
+	bool isFrozen() const { return frozen; }
+
+	// @brief Put the store in ID order and freeze it, ready for lookups
+	// @param sortedFile Whether the .pbf is flagged Sort.Type_then_ID
+	void sort(unsigned int threadNum, bool sortedFile);
+
+	// @brief Find an element by ID, or return nullptr
+	element_t const *find(uint64_t id) const {
+		auto segment = std::upper_bound(firstIds.begin(), firstIds.end(), id);
+		if (segment == firstIds.begin()) return nullptr;
+		auto const &elements = segments[segment - firstIds.begin() - 1];
+		auto iter = std::lower_bound(elements.begin(), elements.end(), id, [](auto const &e, auto id) { 
+			return e.first < id; 
+		});
+		if (iter == elements.end() || iter->first != id) return nullptr;
+		return &*iter;
+	}
+
+	// Non-empty segments in ID order (after sort), and the first ID of each
+	std::vector<segment_t> const &allSegments() const { return segments; }
+	std::vector<uint64_t> const &segmentFirstIds() const { return firstIds; }
+
+private:
+	static bool lessById(element_t const &a, element_t const &b) { return a.first < b.first; }
+
+	mutable std::mutex mutex;
+	std::vector<segment_t> segments;
+	std::vector<uint64_t> firstIds;
+	bool frozen = false;
+};
+
+template<typename T>
+void SegmentedStore<T>::sort(unsigned int threadNum, bool sortedFile) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	// Drop the segments of blocks that had nothing for this store
+	segments.erase(std::remove_if(segments.begin(), segments.end(), [](segment_t const &s) { return s.empty(); }), segments.end());
+
+	// Blocks of a sorted file are in ID order, and so are their segments
+	bool inOrder = true;
+	for (std::size_t i = 0; inOrder && i < segments.size(); i++) {
+		if (i > 0 && !(segments[i-1].back().first < segments[i].front().first)) inOrder = false;
+		if (!sortedFile && !std::is_sorted(segments[i].begin(), segments[i].end(), lessById)) inOrder = false;
+	}
+
+	if (!inOrder) {
+		// Concatenate everything into one segment and sort that
+		segment_t all;
+		std::size_t total = 0;
+		for (auto const &segment : segments) total += segment.size();
+		all.reserve(total);
+		for (auto &segment : segments) {
+			std::move(segment.begin(), segment.end(), std::back_inserter(all));
+			segment_t().swap(segment);
+		}
+		boost::sort::block_indirect_sort(all.begin(), all.end(), lessById, threadNum);
+		segments.clear();
+		segments.emplace_back(std::move(all));
+	}
+
+	firstIds.clear();
+	for (auto const &segment : segments) firstIds.push_back(segment.front().first);
+	frozen = true;
+}
+
+class NodeStore
+{
+
+public:
+	using element_t = std::pair<NodeID, LatpLon>;
+
+	void reopen() { store.reset(1); }
+
+	// @brief Make room for a file with this many blocks
+	void reserve_segments(std::size_t count) { store.reset(count); }
+
 	// @brief Lookup a latp/lon pair
 	// @param i OSM ID of a node
 	// @return Latp/lon pair
 	// @exception NotFound
 	LatpLon at(NodeID i) const {
-		auto iter = std::lower_bound(mLatpLons->begin(), mLatpLons->end(), i, [](auto const &e, auto i) { 
-			return e.first < i; 
-		});
-
-		if(iter == mLatpLons->end() || iter->first != i)
+		element_t const *found = store.find(i);
+		if (found == nullptr)
 			throw std::out_of_range("Could not find node with id " + std::to_string(i));
-
-		return iter->second;
+		return found->second;
 	}
 
+	// @brief Lookup many nodes in one forward pass over the store
+	// @param ids OSM IDs of nodes, in ascending order
+	// @param out Set to the latp/lon pair for each ID that is found
+	// @param found Set to whether each ID was found
+	void at(std::vector<NodeID> const &ids, std::vector<LatpLon> &out, std::vector<bool> &found) const;
+
 	// @brief Return the number of stored items
-	size_t size() const { 
-		std::lock_guard<std::mutex> lock(mutex);
-		return mLatpLons->size(); 
-	}
+	size_t size() const { return store.size(); }
 
 	// @brief Insert a latp/lon pair.
 	// @param i OSM ID of a node
 	// @param coord a latp/lon pair to be inserted
-	// @invariant The OSM ID i must be larger than previously inserted OSM IDs of nodes
-	//			  (though unnecessarily for current impl, future impl may impose that)
 	void insert_back(NodeID i, LatpLon coord) {
-		mLatpLons->push_back(std::make_pair(i, coord));
+		std::vector<element_t> element(1, std::make_pair(i, coord));
+		store.append(element);
 	}
 
-	void insert_back(std::vector<element_t> const &element) {
-		std::lock_guard<std::mutex> lock(mutex);
-		auto i = mLatpLons->size();
-		mLatpLons->resize(i + element.size());
-		std::copy(element.begin(), element.end(), mLatpLons->begin() + i);
+	// @brief Insert the nodes from one block
+	// @param segment Index of the block in the file
+	void insert_back(std::size_t segment, std::vector<element_t> &elements) {
+		store.append(segment, elements);
 	}
 
 	// @brief Make the store empty
-	void clear() { 
-		std::lock_guard<std::mutex> lock(mutex);
-		mLatpLons->clear(); 
-	}
+	void clear() { store.reset(1); }
 
-	void sort(unsigned int threadNum);
+	void sort(unsigned int threadNum, bool sortedFile) { store.sort(threadNum, sortedFile); }
 
 private: 
-	mutable std::mutex mutex;
-	std::shared_ptr<map_t> mLatpLons;
+	SegmentedStore<element_t> store;
 };
 
 class CompactNodeStore
@@ -183,10 +349,10 @@ public:
 			insert_back(i.first, i.second);
 	}
 
-	// @brief Make the store empty
+	// @brief Make the store empty, freeing all its memory; reopen() before using it again
 	void clear() { 
 		std::lock_guard<std::mutex> lock(mutex);
-		mLatpLons->clear(); 
+		mLatpLons.reset(); 
 	}
 
 private: 
@@ -194,145 +360,485 @@ private:
 	std::shared_ptr<map_t> mLatpLons;
 };
 
-// list of ways used by relations
-// by noting these in advance, we don't need to store all ways in the store
-class UsedWays {
+// Node store that keeps nodes in chunks of up to 256, delta- and varint-encoded.
+// Each chunk covers a run of ascending IDs from one block; a sorted index of
+// chunks finds the one holding an ID, and the last few chunks decoded by each
+// thread are cached, as lookups for a way (or nearby ways) tend to hit the same
+// chunks. Uses roughly a quarter of the memory of NodeStore.
+class CompressedNodeStore
+{
+
+public:
+	using element_t = std::pair<NodeID, LatpLon>;
+
+	CompressedNodeStore() = default;
+	~CompressedNodeStore() { clear(); }
+	CompressedNodeStore(CompressedNodeStore const &) = delete;
+	CompressedNodeStore &operator=(CompressedNodeStore const &) = delete;
+
+	void reopen() { clear(); }
+
+	// @brief Lookup a latp/lon pair
+	// @param i OSM ID of a node
+	// @return Latp/lon pair
+	// @exception NotFound
+	LatpLon at(NodeID i) const;
+
+	// @brief Return the number of stored items
+	size_t size() const { 
+		std::lock_guard<std::mutex> lock(mutex);
+		return count; 
+	}
+
+	void insert_back(NodeID i, LatpLon coord) {
+		insert_back(std::vector<element_t>(1, std::make_pair(i, coord)));
+	}
+
+	// @brief Encode a batch of nodes (normally one PrimitiveGroup)
+	void insert_back(std::vector<element_t> const &elements);
+
+	// @brief Make the store empty
+	void clear();
+
+	// @brief Sort the chunk index; must be called after inserting and before lookups
+	void sort(unsigned int threadNum);
+
+	// @brief Bytes used by encoded chunks and the index
+	size_t memoryUsed() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return bytes + chunks.size() * sizeof(Chunk);
+	}
+
+	static constexpr unsigned int ChunkSize = 256;
+
+	struct Chunk {
+		NodeID first;			///< lowest and highest IDs in the chunk
+		NodeID last;
+		uint8_t const *data;	///< varint stream: ID delta, zigzag latp delta, zigzag lon delta per node
+		uint32_t length;		///< bytes in the stream
+		uint32_t nodes;			///< number of nodes
+	};
 
 private:
-	std::vector<bool> usedList;
+	static Chunk encodeChunk(std::vector<element_t>::const_iterator begin, std::vector<element_t>::const_iterator end);
+	static void decodeChunk(Chunk const &chunk, NodeID *ids, LatpLon *coords);
+
 	mutable std::mutex mutex;
+	std::vector<Chunk> chunks;
+	size_t count = 0;
+	size_t bytes = 0;
+	std::atomic<uint64_t> generation { 0 };	// changes whenever cached chunks may be stale
+};
+
+// Node store for unrenumbered IDs, indexed directly by node ID.
+// IDs are split into pages of 256; each page that holds any nodes has a
+// presence bitmap followed by the coordinates of the nodes present, in ID order.
+// Lookups are O(1), and no sort is needed after reading.
+class SparseNodeStore
+{
 
 public:
-	bool inited = false;
+	using element_t = std::pair<NodeID, LatpLon>;
+
+	SparseNodeStore() { reopen(); }
+	~SparseNodeStore() { clear(); }
+	SparseNodeStore(SparseNodeStore const &) = delete;
+	SparseNodeStore &operator=(SparseNodeStore const &) = delete;
+
+	void reopen();
+
+	// @brief Lookup a latp/lon pair
+	// @param i OSM ID of a node
+	// @return Latp/lon pair
+	// @exception NotFound
+	LatpLon at(NodeID i) const {
+		Page const *page = findPage(i);
+		unsigned int bit = i & (PageSize - 1);
+		if (page == nullptr || !(page->present[bit / 64] & (uint64_t(1) << (bit % 64))))
+			throw std::out_of_range("Could not find node with id " + std::to_string(i));
+		return page->coords()[page->rank(bit)];
+	}
 
-	// Size the vector to a reasonable estimate, to avoid resizing on the fly
-	void reserve(bool compact, size_t numNodes) {
+	// @brief Return the number of stored items
+	size_t size() const { 
 		std::lock_guard<std::mutex> lock(mutex);
-		if (inited) return;
-		inited = true;
-		if (compact) {
-			// If we're running in compact mode, way count is roughly 1/9th of node count... say 1/8 to be safe
-			usedList.reserve(numNodes/8);
-		} else {
-			// Otherwise, we could have anything up to the current max node ID (approaching 2**30 in summer 2021)
-			// 2**31 is 0.25GB with a vector<bool>
-			usedList.reserve(pow(2,31));
+		return count; 
+	}
+
+	// @brief Insert a latp/lon pair.
+	// @param i OSM ID of a node
+	// @param coord a latp/lon pair to be inserted
+	// Nodes may arrive in any order; a node inserted twice keeps the later location.
+	void insert_back(NodeID i, LatpLon coord) {
+		insert_back(std::vector<element_t>(1, std::make_pair(i, coord)));
+	}
+
+	void insert_back(std::vector<element_t> const &elements);
+
+	// @brief Make the store empty
+	void clear();
+
+	// @brief Bytes used by pages and the page directory
+	size_t memoryUsed() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return bytes;
+	}
+
+private:
+	static constexpr unsigned int PageBits = 8;
+	static constexpr NodeID PageSize = NodeID(1) << PageBits;
+	static constexpr unsigned int ChunkBits = 12;		// pages per directory chunk (1M IDs)
+	static constexpr NodeID ChunkSize = NodeID(1) << ChunkBits;
+	static constexpr unsigned int MaxIdBits = 36;		// highest node ID is currently ~2^33
+
+	// Allocated as one block: the bitmap, then one LatpLon per bit set
+	struct Page {
+		uint64_t present[PageSize / 64];
+
+		LatpLon *coords() { return reinterpret_cast<LatpLon *>(this + 1); }
+		LatpLon const *coords() const { return reinterpret_cast<LatpLon const *>(this + 1); }
+
+		// Number of nodes present before this bit
+		unsigned int rank(unsigned int bit) const {
+			unsigned int r = 0;
+			for (unsigned int w = 0; w < bit / 64; w++) r += popcount(present[w]);
+			return r + popcount(present[bit / 64] & ((uint64_t(1) << (bit % 64)) - 1));
 		}
+		unsigned int size() const { return rank(PageSize - 1) + ((present[PageSize / 64 - 1] >> 63) & 1); }
+
+		static size_t bytes(size_t nodes) { return sizeof(Page) + nodes * sizeof(LatpLon); }
+	};
+	using chunk_t = std::array<Page *, ChunkSize>;
+
+	static unsigned int popcount(uint64_t x) { return std::bitset<64>(x).count(); }
+
+	Page const *findPage(NodeID i) const {
+		NodeID chunk = i >> (PageBits + ChunkBits);
+		if (chunk >= directory.size() || !directory[chunk]) return nullptr;
+		return (*directory[chunk])[(i >> PageBits) & (ChunkSize - 1)];
 	}
-	
-	// Mark a way as used
+
+	void mergePage(Page *&page, std::vector<element_t>::const_iterator begin, std::vector<element_t>::const_iterator end);
+
+	mutable std::mutex mutex;
+	std::vector<std::unique_ptr<chunk_t>> directory;
+	size_t count = 0;
+	size_t bytes = 0;
+};
+
+// list of ways used by relations
+// by noting these in advance, we don't need to store all ways in the store.
+// A bitmap in pages that are only allocated for the ID ranges relations refer to;
+// ways are marked with an atomic OR, so relation scanning threads don't contend
+class UsedWays {
+
+private:
+	static constexpr unsigned int PageBits = 22;		// 512kB of bits per page
+	static constexpr std::size_t PageWords = (std::size_t(1) << PageBits) / 64;
+	static constexpr unsigned int MaxIdBits = 36;
+	static constexpr std::size_t DirectorySize = std::size_t(1) << (MaxIdBits - PageBits);
+
+	using page_t = std::atomic<uint64_t>;
+
+	// One pointer per page, allocated on first use; pages are never freed until clear()
+	std::unique_ptr<std::atomic<page_t *>[]> directory;
+
+	page_t *page(WayID wayid) {
+		auto &slot = directory[wayid >> PageBits];
+		page_t *found = slot.load(std::memory_order_acquire);
+		if (found) return found;
+		page_t *created = new page_t[PageWords]();
+		if (slot.compare_exchange_strong(found, created, std::memory_order_acq_rel)) return created;
+		delete[] created;		// another thread got there first
+		return found;
+	}
+
+public:
+	UsedWays() : directory(new std::atomic<page_t *>[DirectorySize]()) { }
+	~UsedWays() { clear(); }
+	UsedWays(UsedWays const &) = delete;
+	UsedWays &operator=(UsedWays const &) = delete;
+
+	// Mark a way as used, from any thread
 	void insert(WayID wayid) {
-		std::lock_guard<std::mutex> lock(mutex);
-		if (wayid>usedList.size()) usedList.resize(wayid+256);
-		usedList[wayid] = true;
+		if (wayid >> MaxIdBits)
+			throw std::out_of_range("Way ID " + std::to_string(wayid) + " is too large");
+		page(wayid)[(wayid >> 6) & (PageWords - 1)].fetch_or(uint64_t(1) << (wayid & 63), std::memory_order_relaxed);
 	}
 	
 	// See if a way is used
 	bool at(WayID wayid) const {
-		return (wayid>usedList.size()) ? false : usedList[wayid];
+		if (wayid >> MaxIdBits) return false;
+		page_t const *found = directory[wayid >> PageBits].load(std::memory_order_acquire);
+		if (!found) return false;
+		return (found[(wayid >> 6) & (PageWords - 1)].load(std::memory_order_relaxed) >> (wayid & 63)) & 1;
 	}
 	
+	// Free all pages; must not run alongside insert() or at()
 	void clear() {
-		std::lock_guard<std::mutex> lock(mutex);
-		usedList.clear();
+		for (std::size_t i = 0; i < DirectorySize; i++)
+			delete[] directory[i].exchange(nullptr);
 	}
 };
 
-// scanned relations store
-class RelationScanStore {
+// used nodes store
+// A bitmap of the nodes referenced by ways, in pages which are only allocated
+// for the ranges of node IDs that are actually used
+class UsedNodes {
 
 private:
-	using tag_map_t = boost::container::flat_map<std::string, std::string>;
-	std::map<WayID, std::vector<WayID>> relationsForWays;
-	std::map<WayID, tag_map_t> relationTags;
+	static constexpr unsigned int PageBits = 22;
+	static constexpr std::size_t PageWords = (std::size_t(1) << PageBits) / 64;
+
+	std::vector<std::vector<uint64_t>> pages;
 	mutable std::mutex mutex;
 
 public:
-	void relation_contains_way(WayID relid, WayID wayid) {
+	// Mark the nodes in a list as used
+	void insert(std::vector<NodeID> const &ids) {
 		std::lock_guard<std::mutex> lock(mutex);
-		relationsForWays[wayid].emplace_back(relid);
+		for (NodeID id : ids) {
+			std::size_t page = id >> PageBits;
+			if (page >= pages.size()) pages.resize(page + 1);
+			if (pages[page].empty()) pages[page].resize(PageWords, 0);
+			pages[page][(id >> 6) & (PageWords - 1)] |= uint64_t(1) << (id & 63);
+		}
 	}
-	void store_relation_tags(WayID relid, const tag_map_t &tags) {
+
+	// See if a node is used; only safe once marking has finished
+	bool at(NodeID id) const {
+		std::size_t page = id >> PageBits;
+		if (page >= pages.size() || pages[page].empty()) return false;
+		return (pages[page][(id >> 6) & (PageWords - 1)] >> (id & 63)) & 1;
+	}
+
+	void clear() {
+		std::lock_guard<std::mutex> lock(mutex);
+		pages.clear();
+	}
+};
+
+// scanned relations store
+// While relations are scanned, way memberships and tags are gathered under a lock.
+// sort() then compacts them into sorted arrays: for each way, a span of the
+// relations it's in; for each relation, a span of (key, value) string IDs. From
+// then on lookups take no lock and allocate nothing.
+class RelationScanStore {
+
+public:
+	// The relations a way is in, pointing into the store
+	class relation_list_t {
+	public:
+		relation_list_t() : first(nullptr), last(nullptr) { }
+		relation_list_t(WayID const *first, WayID const *last) : first(first), last(last) { }
+
+		WayID const *begin() const { return first; }
+		WayID const *end() const { return last; }
+		std::size_t size() const { return last - first; }
+		bool empty() const { return first == last; }
+		WayID operator[](std::size_t i) const { return first[i]; }
+
+	private:
+		WayID const *first;
+		WayID const *last;
+	};
+
+	// @brief Note the member ways of a relation that was accepted by the scan
+	void relation_contains_ways(WayID relid, std::vector<WayID> const &wayids) {
 		std::lock_guard<std::mutex> lock(mutex);
-		relationTags[relid] = tags;
+		for (WayID wayid : wayids) pendingWays.emplace_back(wayid, relid);
 	}
-	bool way_in_any_relations(WayID wayid) {
-		return relationsForWays.find(wayid) != relationsForWays.end();
+
+	// @brief Keep the tags of a relation that was accepted by the scan
+	void store_relation_tags(WayID relid, TagList const &tags) {
+		std::lock_guard<std::mutex> lock(mutex);
+		for (TagList::Tag const &tag : tags)
+			pendingTags.push_back({ relid, intern(tag.keyString.str()), intern(tag.value.str()) });
 	}
-	std::vector<WayID> relations_for_way(WayID wayid) {
-		return relationsForWays[wayid];
+
+	// @brief Compact what was scanned into sorted arrays, ready for lookups
+	void sort(unsigned int threadNum);
+
+	bool way_in_any_relations(WayID wayid) const {
+		return findWay(wayid) != wayIds.end();
 	}
-	std::string get_relation_tag(WayID relid, const std::string &key) {
-		auto it = relationTags.find(relid);
-		if (it==relationTags.end()) return "";
-		auto jt = it->second.find(key);
-		if (jt==it->second.end()) return "";
-		return jt->second;
+
+	relation_list_t relations_for_way(WayID wayid) const {
+		auto it = findWay(wayid);
+		if (it == wayIds.end()) return relation_list_t();
+		std::size_t i = it - wayIds.begin();
+		return relation_list_t(relationIds.data() + wayOffsets[i], relationIds.data() + wayOffsets[i+1]);
 	}
+
+	// @brief Value of a tag on a scanned relation, or an empty string
+	std::string const &get_relation_tag(WayID relid, std::string const &key) const;
+
 	void clear() {
 		std::lock_guard<std::mutex> lock(mutex);
-		relationsForWays.clear();
-		relationTags.clear();
+		pendingWays.clear();
+		pendingTags.clear();
+		wayIds.clear();
+		wayOffsets.clear();
+		relationIds.clear();
+		tagRelationIds.clear();
+		tagOffsets.clear();
+		tags.clear();
+		strings.clear();
+		stringIds.clear();
 	}
+
+private:
+	struct PendingTag {
+		WayID relid;
+		uint32_t key;
+		uint32_t value;
+	};
+
+	// Must be called with the mutex held
+	uint32_t intern(std::string const &str) {
+		auto it = stringIds.find(str);
+		if (it != stringIds.end()) return it->second;
+		uint32_t id = strings.size();
+		strings.push_back(str);
+		stringIds.emplace(str, id);
+		return id;
+	}
+
+	std::vector<WayID>::const_iterator findWay(WayID wayid) const {
+		auto it = std::lower_bound(wayIds.begin(), wayIds.end(), wayid);
+		return (it != wayIds.end() && *it == wayid) ? it : wayIds.end();
+	}
+
+	mutable std::mutex mutex;
+	std::vector<std::pair<WayID, WayID>> pendingWays;		// (way, relation)
+	std::vector<PendingTag> pendingTags;
+
+	// Ways in ID order; the relations of way i are relationIds[wayOffsets[i]..wayOffsets[i+1])
+	std::vector<WayID> wayIds;
+	std::vector<std::size_t> wayOffsets;
+	std::vector<WayID> relationIds;
+
+	// Relations in ID order; the tags of relation i are tags[tagOffsets[i]..tagOffsets[i+1]), ordered by key
+	std::vector<WayID> tagRelationIds;
+	std::vector<std::size_t> tagOffsets;
+	std::vector<std::pair<uint32_t, uint32_t>> tags;
+
+	// Tag keys and values, by ID
+	std::deque<std::string> strings;
+	std::unordered_map<std::string, uint32_t> stringIds;
 };
 
 // way store
+// The coordinates of each way are delta- and zigzag/varint-encoded into the arena
+// of the block it came from, and a segmented index maps way IDs to their place in
+// the arenas. Ways are decoded as they are iterated, so lookups copy nothing.
 class WayStore {
 
 public:
-	using latplon_vector_t = std::vector<LatpLon, mmap_allocator<LatpLon>>;
-	using element_t = std::pair<WayID, latplon_vector_t>;
-	using map_t = std::deque<element_t, mmap_allocator<element_t>>;
+	using arena_t = std::vector<uint8_t, mmap_allocator<uint8_t>>;
 
-	void reopen() {
-		mLatpLonLists = std::make_unique<map_t>();
-	}
+	// Where a way's encoding starts: which arena, and the offset within it
+	struct Location {
+		uint32_t arena;
+		uint32_t offset;
+	};
+	using element_t = std::pair<WayID, Location>;
+	using input_t = std::pair<WayID, LatpLonVec>;
+
+	// The coordinates of a stored way
+	class way_t {
+	public:
+		class const_iterator {
+		public:
+			using iterator_category = std::forward_iterator_tag;
+			using value_type = LatpLon;
+			using difference_type = std::ptrdiff_t;
+			using pointer = LatpLon const *;
+			using reference = LatpLon;
+
+			const_iterator(uint8_t const *ptr, uint8_t const *end)
+				: ptr(ptr), next(ptr), end(end), latp(0), lon(0)
+			{ read(); }
+
+			LatpLon operator*() const { return LatpLon{ static_cast<int32_t>(latp), static_cast<int32_t>(lon) }; }
+			const_iterator &operator++() { ptr = next; read(); return *this; }
+			const_iterator operator++(int) { const_iterator old = *this; ++*this; return old; }
+			bool operator==(const_iterator const &other) const { return ptr == other.ptr; }
+			bool operator!=(const_iterator const &other) const { return ptr != other.ptr; }
+
+		private:
+			// Decode the coordinate at ptr, leaving next at the one after it
+			void read() {
+				if (ptr == end) return;
+				latp += unzigzag(readVarint(next));
+				lon  += unzigzag(readVarint(next));
+			}
+
+			uint8_t const *ptr;
+			uint8_t const *next;
+			uint8_t const *end;
+			int64_t latp, lon;
+		};
+
+		way_t(uint8_t const *data, uint8_t const *end) : data(data), dataEnd(end) { }
+
+		const_iterator begin() const { return const_iterator(data, dataEnd); }
+		const_iterator end() const { return const_iterator(dataEnd, dataEnd); }
+		bool empty() const { return data == dataEnd; }
+
+		LatpLon front() const { return *begin(); }
+		LatpLon back() const {
+			LatpLon last = LatpLon{ 0, 0 };
+			for (LatpLon ll : *this) last = ll;
+			return last;
+		}
+
+	private:
+		uint8_t const *data;
+		uint8_t const *dataEnd;
+	};
+
+	void reopen() { reset(1); }
+
+	// @brief Make room for a file with this many blocks
+	void reserve_segments(std::size_t count) { reset(count); }
 
 	// @brief Lookup a node list
 	// @param i OSM ID of a way
 	// @return A node list
 	// @exception NotFound
-	latplon_vector_t const &at(WayID wayid) const {
-		std::lock_guard<std::mutex> lock(mutex);
-		
-		auto iter = std::lower_bound(mLatpLonLists->begin(), mLatpLonLists->end(), wayid, [](auto const &e, auto wayid) { 
-			return e.first < wayid; 
-		});
-
-		if(iter == mLatpLonLists->end() || iter->first != wayid)
+	// Needs no lock, as the store is frozen by sort() before any lookups
+	way_t at(WayID wayid) const {
+		if (!store.isFrozen()) throw std::logic_error("Way store must be sorted before lookups");
+		element_t const *found = store.find(wayid);
+		if (found == nullptr)
 			throw std::out_of_range("Could not find way with id " + std::to_string(wayid));
-
-		return iter->second;
+		uint8_t const *ptr = arenas[found->second.arena].data() + found->second.offset;
+		uint64_t length = readVarint(ptr);
+		return way_t(ptr, ptr + length);
 	}
 
-	// @brief Insert a node list.
-	// @param i OSM ID of a way
-	// @param llVec a coordinate vector to be inserted
-	// @invariant The OSM ID i must be larger than previously inserted OSM IDs of ways
-	//			  (though unnecessarily for current impl, future impl may impose that)
-	void insert_back(std::vector<element_t> &new_ways) {
-		std::lock_guard<std::mutex> lock(mutex);
-		auto i = mLatpLonLists->size();
-		mLatpLonLists->resize(i + new_ways.size());
-		std::copy(std::make_move_iterator(new_ways.begin()), std::make_move_iterator(new_ways.end()), mLatpLonLists->begin() + i); 
-	}
+	// @brief Insert the node lists of the ways in one block
+	// @param segment Index of the block in the file
+	void insert_back(std::size_t segment, std::vector<input_t> const &new_ways);
 
 	// @brief Make the store empty
-	void clear() { 
-		std::lock_guard<std::mutex> lock(mutex);
-		mLatpLonLists->clear(); 
-	}
+	void clear() { reset(1); }
 
-	std::size_t size() const { 
-		std::lock_guard<std::mutex> lock(mutex);
-		return mLatpLonLists->size(); 
-	}
+	std::size_t size() const { return store.size(); }
 
-	void sort(unsigned int threadNum);
+	// @brief Sort the index and freeze the store; no more ways can be inserted until it's cleared
+	void sort(unsigned int threadNum, bool sortedFile);
 
 private:	
-	mutable std::mutex mutex;
-	std::unique_ptr<map_t> mLatpLonLists;
+	void reset(std::size_t count) {
+		store.reset(count);
+		arenas.clear();
+		arenas.resize(std::max<std::size_t>(count, 1));
+	}
+
+	SegmentedStore<element_t> store;
+	std::vector<arena_t> arenas;
 };
 
 // relation store
@@ -344,35 +850,25 @@ public:
 	using relation_entry_t = std::pair<wayid_vector_t, wayid_vector_t>;
 
 	using element_t = std::pair<WayID, relation_entry_t>;
-	using map_t = std::deque<element_t, mmap_allocator<element_t>>;
 
-	void reopen() {
-		std::lock_guard<std::mutex> lock(mutex);
-		mOutInLists = std::make_unique<map_t>();
-	}
+	void reopen() { store.reset(1); }
 
-	// @brief Insert a list of relations
-	void insert_front(std::vector<element_t> &new_relations) {
-		std::lock_guard<std::mutex> lock(mutex);
-		auto i = mOutInLists->size();
-		mOutInLists->resize(i + new_relations.size());
-		std::copy(std::make_move_iterator(new_relations.begin()), std::make_move_iterator(new_relations.end()), mOutInLists->begin() + i); 
+	// @brief Make room for a file with this many blocks
+	void reserve_segments(std::size_t count) { store.reset(count); }
+
+	// @brief Insert the relations in one block
+	// @param segment Index of the block in the file
+	void insert_front(std::size_t segment, std::vector<element_t> &new_relations) {
+		store.append(segment, new_relations);
 	}
 
 	// @brief Make the store empty
-	void clear() {
-		std::lock_guard<std::mutex> lock(mutex);
-		mOutInLists->clear();
-	}
+	void clear() { store.reset(1); }
 
-	std::size_t size() const {
-		std::lock_guard<std::mutex> lock(mutex);
-		return mOutInLists->size(); 
-	}
+	std::size_t size() const { return store.size(); }
 
 private: 	
-	mutable std::mutex mutex;
-	std::unique_ptr<map_t> mOutInLists;
+	SegmentedStore<element_t> store;
 };
 
 /**
@@ -389,24 +885,40 @@ private:
 	Such data structures have to return const ForwardInputIterators (only *, ++ and == should be supported).
 
 	Possible future improvements to save memory:
-	- pack WayStore (e.g. zigzag PBF encoding and varint)
 	- combine innerWays and outerWays into one vector, with a single-byte index marking the changeover
 	- use two arrays (sorted keys and elements) instead of map
 */
 class OSMStore
 {
 public:
-	using point_store_t = std::deque<std::pair<NodeID, Point>>;
+	// Which store holds node locations
+	enum class NodeStoreType {
+		Sorted,		///< (ID, location) pairs, sorted after reading; works with any IDs
+		Compact,	///< indexed by ID; needs the input to be renumbered
+		Sparse,		///< paged by ID with a presence bitmap; works with any IDs
+		Compressed	///< delta/varint-encoded chunks; smallest for unrenumbered IDs
+	};
 
-	using linestring_t = boost::geometry::model::linestring<Point, std::vector, mmap_allocator>;
-	using linestring_store_t = std::deque<std::pair<NodeID, linestring_t>>;
+	// Generated geometries are kept in deques, which never move an element once it's
+	// stored; the handle returned by store_* is its address, so retrieval is a dereference.
+	// Vertices are kept as fixed-point latp/lon, the precision of the input, and only
+	// expanded to doubles by retrieve_* when a geometry is clipped for a tile.
+	using handle_t = void *;
+
+	using point_store_t = std::deque<LatpLon>;
 
-	using multi_linestring_t = boost::geometry::model::multi_linestring<linestring_t, std::vector, mmap_allocator>;
-	using multi_linestring_store_t = std::deque<std::pair<NodeID, multi_linestring_t>>;
+	using linestring_t = std::vector<LatpLon, generated_allocator<LatpLon>>;
+	using linestring_store_t = std::deque<linestring_t>;
 
-	using polygon_t = boost::geometry::model::polygon<Point, true, true, std::vector, std::vector, mmap_allocator, mmap_allocator>;
-	using multi_polygon_t = boost::geometry::model::multi_polygon<polygon_t, std::vector, mmap_allocator>;
-	using multi_polygon_store_t = std::deque<std::pair<NodeID, multi_polygon_t>>;
+	// The vertices of every part end to end, and the number of vertices in each part.
+	// For a multi-polygon, each polygon's entry in parts is its number of rings,
+	// followed by the size of its outer ring and then of each inner ring.
+	struct packed_geometry_t {
+		std::vector<LatpLon, generated_allocator<LatpLon>> points;
+		std::vector<uint32_t, generated_allocator<uint32_t>> parts;
+	};
+	using multi_linestring_store_t = std::deque<packed_geometry_t>;
+	using multi_polygon_store_t = std::deque<packed_geometry_t>;
 
 	struct generated {
 		std::mutex points_store_mutex;
@@ -425,20 +937,40 @@ public:
 protected:	
 	NodeStore nodes;
 	CompactNodeStore compact_nodes;
-	bool use_compact_nodes = false;
+	SparseNodeStore sparse_nodes;
+	CompressedNodeStore compressed_nodes;
+	NodeStoreType node_store_type = NodeStoreType::Sorted;
 	bool require_integrity = true;
 
 	WayStore ways;
 	RelationStore relations;
 	UsedWays used_ways;
+	UsedNodes used_nodes;
 	RelationScanStore scanned_relations;
 
 	generated osm_generated;
 	generated shp_generated;
 
+	// Convert between vertices in degrees and fixed-point latp/lon; packPoints appends,
+	// so callers reserve room for every part up front
+	template<typename Output, typename Input>
+	static void packPoints(Output &dst, Input const &src) {
+		for (auto const &p : src)
+			dst.push_back(LatpLon{ static_cast<int32_t>(std::lround(p.y() * 10000000.0)), static_cast<int32_t>(std::lround(p.x() * 10000000.0)) });
+	}
+
+	template<typename Output>
+	static void unpackPoints(Output &dst, LatpLon const *src, std::size_t count) {
+		dst.reserve(count);
+		for (std::size_t i = 0; i < count; ++i)
+			dst.push_back(Point(src[i].lon / 10000000.0, src[i].latp / 10000000.0));
+	}
+
 	void reopen() {
 		nodes.reopen();
 		compact_nodes.reopen();
+		sparse_nodes.reopen();
+		compressed_nodes.reopen();
 		ways.reopen();
 		relations.reopen();
 		
@@ -461,162 +993,206 @@ public:
 
 	void open(std::string const &osm_store_filename);
 
-	void use_compact_store(bool use = true) { use_compact_nodes = use; }
+	void use_node_store(NodeStoreType type) { node_store_type = type; }
 	void enforce_integrity(bool ei  = true) { require_integrity = ei; }
 	bool integrity_enforced() { return require_integrity; }
 
-	void shapes_sort(unsigned int threadNum = 1);
-	void generated_sort(unsigned int threadNum = 1);
-
 	void nodes_insert_back(NodeID i, LatpLon coord) {
-		if(!use_compact_nodes)
-			nodes.insert_back(i, coord);
-		else
-			compact_nodes.insert_back(i, coord);
+		switch (node_store_type) {
+			case NodeStoreType::Sorted:  nodes.insert_back(i, coord); break;
+			case NodeStoreType::Compact: compact_nodes.insert_back(i, coord); break;
+			case NodeStoreType::Sparse:  sparse_nodes.insert_back(i, coord); break;
+			case NodeStoreType::Compressed: compressed_nodes.insert_back(i, coord); break;
+		}
 	}
-	void nodes_insert_back(std::vector<NodeStore::element_t> const &new_nodes) {
-		if(!use_compact_nodes)
-			nodes.insert_back(new_nodes);
-		else
-			compact_nodes.insert_back(new_nodes);
+	// Segmented stores are filled one segment per .pbf block, so that threads
+	// don't contend; reserve_segments sizes them at the start of each file
+	void reserve_segments(std::size_t blocks) {
+		nodes.reserve_segments(blocks);
+		ways.reserve_segments(blocks);
+		relations.reserve_segments(blocks);
+		void_mmap_allocator::advise(void_mmap_allocator::Access::Sequential);
 	}
-	void nodes_sort(unsigned int threadNum);
-	std::size_t nodes_size() {
-		return use_compact_nodes ? compact_nodes.size() : nodes.size();
+
+	void nodes_insert_back(std::size_t segment, std::vector<NodeStore::element_t> &new_nodes) {
+		switch (node_store_type) {
+			case NodeStoreType::Sorted:  nodes.insert_back(segment, new_nodes); break;
+			case NodeStoreType::Compact: compact_nodes.insert_back(new_nodes); break;
+			case NodeStoreType::Sparse:  sparse_nodes.insert_back(new_nodes); break;
+			case NodeStoreType::Compressed: compressed_nodes.insert_back(new_nodes); break;
+		}
+	}
+	void nodes_sort(unsigned int threadNum, bool sortedFile = false);
+	std::size_t nodes_size() const {
+		switch (node_store_type) {
+			case NodeStoreType::Compact: return compact_nodes.size();
+			case NodeStoreType::Sparse:  return sparse_nodes.size();
+			case NodeStoreType::Compressed: return compressed_nodes.size();
+			default:                     return nodes.size();
+		}
 	}
 
 	LatpLon nodes_at(NodeID i) const { 
-		return use_compact_nodes ? compact_nodes.at(i) : nodes.at(i);
+		switch (node_store_type) {
+			case NodeStoreType::Compact: return compact_nodes.at(i);
+			case NodeStoreType::Sparse:  return sparse_nodes.at(i);
+			case NodeStoreType::Compressed: return compressed_nodes.at(i);
+			default:                     return nodes.at(i);
+		}
 	}
 
-	void ways_insert_back(std::vector<WayStore::element_t> &new_ways) {
-		ways.insert_back(new_ways);
+	// Lookup many nodes at once: ids must be in ascending order, and out/found
+	// are resized to match
+	void nodes_at(std::vector<NodeID> const &ids, std::vector<LatpLon> &out, std::vector<bool> &found) const;
+
+	void ways_insert_back(std::size_t segment, std::vector<WayStore::input_t> const &new_ways) {
+		ways.insert_back(segment, new_ways);
 	}
-	void ways_sort(unsigned int threadNum);
+	void ways_sort(unsigned int threadNum, bool sortedFile = false);
 
-	void relations_insert_front(std::vector<RelationStore::element_t> &new_relations) {
-		relations.insert_front(new_relations);
+	void relations_insert_front(std::size_t segment, std::vector<RelationStore::element_t> &new_relations) {
+		relations.insert_front(segment, new_relations);
 	}
-	void relations_sort(unsigned int threadNum);
 
 	void mark_way_used(WayID i) { used_ways.insert(i); }
-	bool way_is_used(WayID i) { return used_ways.at(i); }
-	void ensure_used_ways_inited() {
-		if (!used_ways.inited) used_ways.reserve(use_compact_nodes, nodes_size());
-	}
+	bool way_is_used(WayID i) const { return used_ways.at(i); }
+
+	void mark_nodes_used(std::vector<NodeID> const &ids) { used_nodes.insert(ids); }
+	bool node_is_used(NodeID i) const { return used_nodes.at(i); }
+	void clear_used_nodes() { used_nodes.clear(); }
 	
-	using tag_map_t = boost::container::flat_map<std::string, std::string>;
-	void relation_contains_way(WayID relid, WayID wayid) { scanned_relations.relation_contains_way(relid,wayid); }
-	void store_relation_tags(WayID relid, const tag_map_t &tags) { scanned_relations.store_relation_tags(relid,tags); }
-	bool way_in_any_relations(WayID wayid) { return scanned_relations.way_in_any_relations(wayid); }
-	std::vector<WayID> relations_for_way(WayID wayid) { return scanned_relations.relations_for_way(wayid); }
-	std::string get_relation_tag(WayID relid, const std::string &key) { return scanned_relations.get_relation_tag(relid, key); }
+	void relation_contains_ways(WayID relid, std::vector<WayID> const &wayids) { scanned_relations.relation_contains_ways(relid, wayids); }
+	void store_relation_tags(WayID relid, TagList const &tags) { scanned_relations.store_relation_tags(relid, tags); }
+	void scanned_relations_sort(unsigned int threadNum) { scanned_relations.sort(threadNum); }
+	bool way_in_any_relations(WayID wayid) const { return scanned_relations.way_in_any_relations(wayid); }
+	RelationScanStore::relation_list_t relations_for_way(WayID wayid) const { return scanned_relations.relations_for_way(wayid); }
+	std::string const &get_relation_tag(WayID relid, const std::string &key) const { return scanned_relations.get_relation_tag(relid, key); }
 
 	generated &osm() { return osm_generated; }
 	generated const &osm() const { return osm_generated; }
 	generated &shp() { return shp_generated; }
 	generated const &shp() const { return shp_generated; }
 
-	using handle_t = void *;
-
 	template<typename T>
-	void store_point(generated &store, NodeID id, T const &input) {	
+	handle_t store_point(generated &store, T const &input) {
+		// Points are already in fixed-point units
+		LatpLon ll = LatpLon{ static_cast<int32_t>(std::lround(input.y())), static_cast<int32_t>(std::lround(input.x())) };
 		std::lock_guard<std::mutex> lock(store.points_store_mutex);
-		store.points_store->emplace_back(id, input);		   	
+		store.points_store->emplace_back(ll);
+		return &store.points_store->back();
 	}
 
-	Point const &retrieve_point(generated const &store, NodeID id) const {
-		auto iter = std::lower_bound(store.points_store->begin(), store.points_store->end(), id, [](auto const &e, auto id) { 
-			return e.first < id; 
-		});
-
-		if(iter == store.points_store->end() || iter->first != id)
-			throw std::out_of_range("Could not find generated node with id " + std::to_string(id));
-
-		return iter->second;
+	static Point retrieve_point(handle_t handle) {
+		LatpLon const &ll = *static_cast<LatpLon const *>(handle);
+		return Point(ll.lon, ll.latp);
 	}
 	
 	template<typename Input>
-	void store_linestring(generated &store, NodeID id, Input const &src)
+	handle_t store_linestring(generated &store, Input const &src)
 	{
-		linestring_t dst(src.begin(), src.end());
+		linestring_t dst;
+		dst.reserve(src.size());
+		packPoints(dst, src);
 
 		std::lock_guard<std::mutex> lock(store.linestring_store_mutex);
-		store.linestring_store->emplace_back(id, std::move(dst));
+		store.linestring_store->emplace_back(std::move(dst));
+		return &store.linestring_store->back();
 	}
 
-	linestring_t const &retrieve_linestring(generated const &store, NodeID id) const {
-		auto iter = std::lower_bound(store.linestring_store->begin(), store.linestring_store->end(), id, [](auto const &e, auto id) { 
-			return e.first < id; 
-		});
-
-		if(iter == store.linestring_store->end() || iter->first != id)
-			throw std::out_of_range("Could not find generated linestring with id " + std::to_string(id));
-
-		return iter->second;
+	static Linestring retrieve_linestring(handle_t handle) {
+		linestring_t const &src = *static_cast<linestring_t const *>(handle);
+		Linestring ls;
+		unpackPoints(ls, src.data(), src.size());
+		return ls;
 	}
 	
 	template<typename Input>
-	void store_multi_linestring(generated &store, NodeID id, Input const &src)
+	handle_t store_multi_linestring(generated &store, Input const &src)
 	{
-		multi_linestring_t dst;
-		dst.resize(src.size());
-		for (std::size_t i=0; i<src.size(); ++i) {
-			boost::geometry::assign(dst[i], src[i]);
+		packed_geometry_t dst;
+		std::size_t points = 0;
+		for (auto const &ls : src) points += ls.size();
+		dst.points.reserve(points);
+		dst.parts.reserve(src.size());
+		for (auto const &ls : src) {
+			dst.parts.push_back(ls.size());
+			packPoints(dst.points, ls);
 		}
 
 		std::lock_guard<std::mutex> lock(store.multi_linestring_store_mutex);
-		store.multi_linestring_store->emplace_back(id, std::move(dst));
+		store.multi_linestring_store->emplace_back(std::move(dst));
+		return &store.multi_linestring_store->back();
 	}
 
-	multi_linestring_t const &retrieve_multi_linestring(generated const &store, NodeID id) const {
-		auto iter = std::lower_bound(store.multi_linestring_store->begin(), store.multi_linestring_store->end(), id, [](auto const &e, auto id) { 
-			return e.first < id; 
-		});
-
-		if(iter == store.multi_linestring_store->end() || iter->first != id)
-			throw std::out_of_range("Could not find generated multi-linestring with id " + std::to_string(id));
-
-		return iter->second;
+	static MultiLinestring retrieve_multi_linestring(handle_t handle) {
+		packed_geometry_t const &src = *static_cast<packed_geometry_t const *>(handle);
+		MultiLinestring mls;
+		mls.resize(src.parts.size());
+		LatpLon const *ptr = src.points.data();
+		for (std::size_t i = 0; i < src.parts.size(); ++i) {
+			unpackPoints(mls[i], ptr, src.parts[i]);
+			ptr += src.parts[i];
+		}
+		return mls;
 	}
 
 	template<typename Input>
-	void store_multi_polygon(generated &store, NodeID id, Input const &src)
+	handle_t store_multi_polygon(generated &store, Input const &src)
 	{
-		multi_polygon_t dst;
-		dst.resize(src.size());
-		for(std::size_t i = 0; i < src.size(); ++i) {
-			dst[i].outer().resize(src[i].outer().size());
-			boost::geometry::assign(dst[i].outer(), src[i].outer());
-
-			dst[i].inners().resize(src[i].inners().size());
-			for(std::size_t j = 0; j < src[i].inners().size(); ++j) {
-				dst[i].inners()[j].resize(src[i].inners()[j].size());
-				boost::geometry::assign(dst[i].inners()[j], src[i].inners()[j]);
+		packed_geometry_t dst;
+		std::size_t points = 0, parts = 0;
+		for (auto const &polygon : src) {
+			points += polygon.outer().size();
+			for (auto const &inner : polygon.inners()) points += inner.size();
+			parts += 2 + polygon.inners().size();
+		}
+		dst.points.reserve(points);
+		dst.parts.reserve(parts);
+		for (auto const &polygon : src) {
+			dst.parts.push_back(1 + polygon.inners().size());
+			dst.parts.push_back(polygon.outer().size());
+			packPoints(dst.points, polygon.outer());
+			for (auto const &inner : polygon.inners()) {
+				dst.parts.push_back(inner.size());
+				packPoints(dst.points, inner);
 			}
 		}
 		
 		std::lock_guard<std::mutex> lock(store.multi_polygon_store_mutex);
-		store.multi_polygon_store->emplace_back(id, std::move(dst));
+		store.multi_polygon_store->emplace_back(std::move(dst));
+		return &store.multi_polygon_store->back();
 	}
 
-	multi_polygon_t const &retrieve_multi_polygon(generated const &store, NodeID id) const {
-		auto iter = std::lower_bound(store.multi_polygon_store->begin(), store.multi_polygon_store->end(), id, [](auto const &e, auto id) { 
-			return e.first < id; 
-		});
-
-		if(iter == store.multi_polygon_store->end() || iter->first != id)
-			throw std::out_of_range("Could not find generated multi polygon with id " + std::to_string(id));
-
-		return iter->second;
+	static MultiPolygon retrieve_multi_polygon(handle_t handle) {
+		packed_geometry_t const &src = *static_cast<packed_geometry_t const *>(handle);
+		MultiPolygon mp;
+		LatpLon const *ptr = src.points.data();
+		for (std::size_t i = 0; i < src.parts.size(); ) {
+			std::size_t rings = src.parts[i++];
+			mp.emplace_back();
+			mp.back().inners().resize(rings - 1);
+			for (std::size_t r = 0; r < rings; ++r, ++i) {
+				if (r == 0) unpackPoints(mp.back().outer(), ptr, src.parts[i]);
+				else unpackPoints(mp.back().inners()[r-1], ptr, src.parts[i]);
+				ptr += src.parts[i];
+			}
+		}
+		return mp;
 	}
 
 	void clear() {
 		nodes.clear();
 		compact_nodes.clear();
+		sparse_nodes.clear();
+		compressed_nodes.clear();
 		ways.clear();
 		relations.clear();
 		used_ways.clear();
+		used_nodes.clear();
+
+		// Nothing in the store arena is in use now, so it can go all at once
+		void_mmap_allocator::release(void_mmap_allocator::StoreArena);
+		compact_nodes.reopen();
 	} 
 
 	void reportStoreSize(std::ostringstream &str);
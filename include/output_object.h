@@ -43,9 +43,9 @@ std::ostream& operator<<(std::ostream& os, OutputGeometryType geomType);
 class OutputObject {
 
 protected:	
-	OutputObject(OutputGeometryType type, uint_least8_t l, NodeID id, AttributeStoreRef attributes, uint mz) 
+	OutputObject(OutputGeometryType type, uint_least8_t l, NodeID id, OSMStore::handle_t handle, AttributeStoreRef attributes, uint mz) 
 		: objectID(id), geomType(type), layer(l), z_order(0),
-		  minZoom(mz), attributes(attributes)
+		  minZoom(mz), attributes(attributes), handle(handle)
 	{ }
 
 
@@ -57,6 +57,7 @@ public:
 	unsigned minZoom 			: 4;
 
 	AttributeStoreRef attributes;
+	OSMStore::handle_t handle;							// where the geometry is in the OSMStore
 
 	void setZOrder(const ZOrder z) {
 #ifndef FLOAT_Z_ORDER
@@ -94,8 +95,8 @@ public:
 class OutputObjectOsmStorePoint : public OutputObject
 {
 public:
-	OutputObjectOsmStorePoint(OutputGeometryType type, uint_least8_t l, NodeID id, AttributeStoreRef attributes, uint minzoom)
-		: OutputObject(type, l, id, attributes, minzoom)
+	OutputObjectOsmStorePoint(OutputGeometryType type, uint_least8_t l, NodeID id, OSMStore::handle_t handle, AttributeStoreRef attributes, uint minzoom)
+		: OutputObject(type, l, id, handle, attributes, minzoom)
 	{ 
 		assert(type == POINT_);
 	}
@@ -104,8 +105,8 @@ public:
 class OutputObjectOsmStoreLinestring : public OutputObject
 {
 public:
-	OutputObjectOsmStoreLinestring(OutputGeometryType type, uint_least8_t l, NodeID id, AttributeStoreRef attributes, uint minzoom)
-		: OutputObject(type, l, id, attributes, minzoom)
+	OutputObjectOsmStoreLinestring(OutputGeometryType type, uint_least8_t l, NodeID id, OSMStore::handle_t handle, AttributeStoreRef attributes, uint minzoom)
+		: OutputObject(type, l, id, handle, attributes, minzoom)
 	{ 
 		assert(type == LINESTRING_);
 	}
@@ -114,8 +115,8 @@ public:
 class OutputObjectOsmStoreMultiLinestring : public OutputObject
 {
 public:
-	OutputObjectOsmStoreMultiLinestring(OutputGeometryType type, uint_least8_t l, NodeID id, AttributeStoreRef attributes, uint minzoom)
-		: OutputObject(type, l, id, attributes, minzoom)
+	OutputObjectOsmStoreMultiLinestring(OutputGeometryType type, uint_least8_t l, NodeID id, OSMStore::handle_t handle, AttributeStoreRef attributes, uint minzoom)
+		: OutputObject(type, l, id, handle, attributes, minzoom)
 	{ 
 		assert(type == MULTILINESTRING_);
 	}
@@ -125,8 +126,8 @@ public:
 class OutputObjectOsmStoreMultiPolygon : public OutputObject
 {
 public:
-	OutputObjectOsmStoreMultiPolygon(OutputGeometryType type, uint_least8_t l, NodeID id, AttributeStoreRef attributes, uint minzoom)
-		: OutputObject(type, l, id, attributes, minzoom)
+	OutputObjectOsmStoreMultiPolygon(OutputGeometryType type, uint_least8_t l, NodeID id, OSMStore::handle_t handle, AttributeStoreRef attributes, uint minzoom)
+		: OutputObject(type, l, id, handle, attributes, minzoom)
 	{ 
 		assert(type == POLYGON_);
 	}
@@ -23,6 +23,12 @@ void readMessage(google::protobuf::Message *message, std::istream &input, unsign
 BlobHeader readHeader(std::istream &input);
 void readBlock(google::protobuf::Message *messagePtr, std::size_t datasize, std::istream &input);
 
+// The same, parsing directly from a buffer (e.g. a memory-mapped .pbf) without copying.
+// readHeader advances offset past the header; it returns false when there is no
+// complete header and blob left in the buffer.
+bool readHeader(BlobHeader &bh, char const *data, std::size_t size, std::size_t &offset);
+void readBlock(google::protobuf::Message *messagePtr, char const *data, std::size_t datasize);
+
 void writeBlock(google::protobuf::Message *messagePtr, std::ostream &output, std::string headerType);
 /* -------------------
    Tag handling
@@ -0,0 +1,275 @@
+/*! \file */
+#ifndef _PBF_DECODER_H
+#define _PBF_DECODER_H
+
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/* -------------------
+   Minimal decoder for the osmformat.proto wire format
+
+   PrimitiveBlocks are read straight from the inflated buffer: messages are
+   views over byte ranges, and packed repeated fields are walked with
+   iterators (unpacked ones are gathered into a small buffer first). Reading a block creates no protobuf message objects.
+   ------------------- */
+
+/// A range of bytes within a buffer
+struct PbfSlice {
+	char const *data = nullptr;
+	std::size_t size = 0;
+
+	bool empty() const { return size == 0; }
+	std::string str() const { return std::string(data, size); }
+	bool operator==(char const *str) const { return std::strlen(str) == size && std::memcmp(data, str, size) == 0; }
+};
+
+/// Read a base-128 varint, advancing ptr
+inline uint64_t pbfReadVarint(char const *&ptr, char const *end) {
+	uint64_t result = 0;
+	for (unsigned int shift = 0; shift < 64 && ptr < end; shift += 7) {
+		uint8_t byte = static_cast<uint8_t>(*ptr++);
+		result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) return result;
+	}
+	throw std::runtime_error("Malformed varint in .pbf");
+}
+
+/// Undo zigzag encoding (sint32/sint64 fields)
+inline int64_t pbfZigZag(uint64_t value) {
+	return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+/// Cursor over the fields of one message
+class PbfFieldReader {
+public:
+	enum WireType { Varint = 0, Fixed64 = 1, Bytes = 2, Fixed32 = 5 };
+
+	PbfFieldReader(PbfSlice message)
+		: ptr(message.data), end(message.data + message.size), fieldNumber(0), wireType(0)
+	{ }
+
+	// Move to the next field; returns false at the end of the message
+	bool next() {
+		if (ptr >= end) return false;
+		uint64_t key = pbfReadVarint(ptr, end);
+		fieldNumber = static_cast<uint32_t>(key >> 3);
+		wireType = static_cast<unsigned int>(key & 7);
+		return true;
+	}
+
+	uint32_t field() const { return fieldNumber; }
+
+	uint64_t varint() { return pbfReadVarint(ptr, end); }
+	int64_t svarint() { return pbfZigZag(varint()); }
+
+	PbfSlice bytes() {
+		uint64_t length = varint();
+		if (length > static_cast<uint64_t>(end - ptr)) throw std::runtime_error("Truncated field in .pbf");
+		PbfSlice slice;
+		slice.data = ptr;
+		slice.size = static_cast<std::size_t>(length);
+		ptr += length;
+		return slice;
+	}
+
+	// The varints in one occurrence of a repeated field: a packed run, or (if the
+	// writer didn't pack the field) a single value
+	PbfSlice repeated() {
+		if (wireType == Bytes) return bytes();
+		if (wireType != Varint) throw std::runtime_error("Unsupported wire type for repeated field in .pbf");
+		PbfSlice slice;
+		slice.data = ptr;
+		varint();
+		slice.size = static_cast<std::size_t>(ptr - slice.data);
+		return slice;
+	}
+
+	void skip() {
+		switch (wireType) {
+			case Varint:  varint(); break;
+			case Fixed64: advance(8); break;
+			case Bytes:   bytes(); break;
+			case Fixed32: advance(4); break;
+			default: throw std::runtime_error("Unsupported wire type in .pbf");
+		}
+	}
+
+private:
+	void advance(std::size_t n) {
+		if (n > static_cast<std::size_t>(end - ptr)) throw std::runtime_error("Truncated field in .pbf");
+		ptr += n;
+	}
+
+	char const *ptr;
+	char const *end;
+	uint32_t fieldNumber;
+	unsigned int wireType;
+};
+
+/// A repeated varint field, decoded as it is iterated
+template<typename T, bool ZigZag>
+class PbfPacked {
+public:
+	class const_iterator {
+	public:
+		using iterator_category = std::input_iterator_tag;
+		using value_type = T;
+		using difference_type = std::ptrdiff_t;
+		using pointer = T const *;
+		using reference = T;
+
+		const_iterator(char const *ptr, char const *end)
+			: ptr(ptr), nextPtr(ptr), end(end), value(0)
+		{ read(); }
+
+		T operator*() const { return value; }
+		const_iterator &operator++() { ptr = nextPtr; read(); return *this; }
+		bool operator==(const_iterator const &other) const { return ptr == other.ptr; }
+		bool operator!=(const_iterator const &other) const { return ptr != other.ptr; }
+
+	private:
+		void read() {
+			if (ptr >= end) return;
+			nextPtr = ptr;
+			uint64_t raw = pbfReadVarint(nextPtr, end);
+			value = ZigZag ? static_cast<T>(pbfZigZag(raw)) : static_cast<T>(raw);
+		}
+
+		char const *ptr;
+		char const *nextPtr;
+		char const *end;
+		T value;
+	};
+
+	PbfPacked() { }
+	PbfPacked(PbfSlice values) : values(values) { }
+
+	// Add one occurrence of the field. A single packed run is walked in place; values
+	// written unpacked, or split over several runs, are gathered into a buffer first.
+	void read(PbfFieldReader &reader) {
+		PbfSlice run = reader.repeated();
+		if (values.empty() && !buffer) { values = run; return; }
+		if (!buffer) buffer = std::make_shared<std::string>(values.data, values.size);
+		buffer->append(run.data, run.size);
+		values.data = buffer->data();
+		values.size = buffer->size();
+	}
+
+	const_iterator begin() const { return const_iterator(values.data, values.data + values.size); }
+	const_iterator end() const { return const_iterator(values.data + values.size, values.data + values.size); }
+	bool empty() const { return values.empty(); }
+
+	// Number of values (one terminating byte per varint)
+	std::size_t size() const {
+		std::size_t count = 0;
+		for (std::size_t i = 0; i < values.size; i++) {
+			if (!(values.data[i] & 0x80)) count++;
+		}
+		return count;
+	}
+
+private:
+	PbfSlice values;
+	std::shared_ptr<std::string> buffer;	// shared, so copies of the message still point at it
+};
+
+using PbfPackedUInt32 = PbfPacked<uint32_t, false>;
+using PbfPackedInt32  = PbfPacked<int32_t,  false>;
+using PbfPackedSInt64 = PbfPacked<int64_t,  true>;
+
+/// Columns of a DenseNodes message (ids, lats and lons are delta coded)
+struct PbfDenseNodes {
+	PbfDenseNodes() { }
+	explicit PbfDenseNodes(PbfSlice message);
+
+	PbfPackedSInt64 ids, lats, lons;
+	PbfPackedInt32 keysVals;
+};
+
+struct PbfWay {
+	explicit PbfWay(PbfSlice message);
+
+	int64_t id = 0;
+	PbfPackedUInt32 keys, vals;
+	PbfPackedSInt64 refs, lats, lons;
+};
+
+struct PbfRelation {
+	explicit PbfRelation(PbfSlice message);
+
+	int64_t id = 0;
+	PbfPackedUInt32 keys, vals;
+	PbfPackedInt32 rolesSid, types;
+	PbfPackedSInt64 memids;
+
+	enum MemberType { Node = 0, Way = 1, Relation = 2 };
+};
+
+/// The members of a PrimitiveGroup (plain Nodes and ChangeSets are not used by tilemaker)
+struct PbfPrimitiveGroup {
+	explicit PbfPrimitiveGroup(PbfSlice message);
+
+	bool hasDense() const { return hasDenseNodes; }
+
+	PbfDenseNodes dense;
+	std::vector<PbfSlice> ways;
+	std::vector<PbfSlice> relations;
+
+private:
+	bool hasDenseNodes = false;
+};
+
+class PbfStringTable {
+public:
+	std::size_t size() const { return strings.size(); }
+	PbfSlice const &operator[](std::size_t i) const { return strings.at(i); }
+	std::string str(std::size_t i) const { return strings.at(i).str(); }
+
+	// Position of a string in the table, or -1 if it is not there
+	int find(char const *str) const;
+
+	void read(PbfSlice message);
+
+private:
+	std::vector<PbfSlice> strings;
+};
+
+/**
+ *\brief An inflated PrimitiveBlock, indexed for reading
+ *
+ * Owns the uncompressed block; the string table and groups point into it, so
+ * a block can't be copied or moved once constructed.
+ */
+class PbfPrimitiveBlock {
+public:
+	// Read and inflate a Blob, then index the PrimitiveBlock it contains
+	PbfPrimitiveBlock(char const *blob, std::size_t size);
+	PbfPrimitiveBlock(PbfPrimitiveBlock const &) = delete;
+	PbfPrimitiveBlock &operator=(PbfPrimitiveBlock const &) = delete;
+
+	PbfStringTable const &stringTable() const { return strings; }
+	std::vector<PbfPrimitiveGroup> const &groups() const { return primitiveGroups; }
+
+	// Approximate memory held by this block
+	std::size_t memoryUsed() const;
+
+private:
+	std::string buffer;
+	PbfStringTable strings;
+	std::vector<PbfPrimitiveGroup> primitiveGroups;
+};
+
+/**
+ * Read the uncompressed contents of a Blob message into out
+ *
+ * Handles raw and zlib blobs, plus zstd and lz4 blobs when tilemaker is built
+ * with those libraries (HAVE_ZSTD, HAVE_LZ4). Throws for other compressions.
+ */
+void pbfReadBlob(char const *data, std::size_t size, std::string &out);
+
+#endif //_PBF_DECODER_H
@@ -0,0 +1,38 @@
+/*! \file */
+#ifndef _PBF_INDEX_H
+#define _PBF_INDEX_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ *\brief Index of the blocks in a .pbf file, kept in a small file alongside it
+ *
+ * Records where each block is and what it contains, so that later runs don't need
+ * to scan the file's headers, and each read phase only visits the blocks it needs.
+ * The index is tied to the size and modification time of the .pbf, and is ignored
+ * (and rewritten) if either changes, or if a block's header isn't where it says.
+ */
+class PbfBlockIndex {
+public:
+	struct Block {
+		uint64_t headerOffset;	///< offset of the BlobHeader, checked against the file before the index is used
+		uint64_t offset;	///< offset of the Blob within the file
+		uint64_t length;	///< length of the Blob
+		uint32_t phases;	///< PbfReader::ReadPhase values with something to do in this block
+	};
+
+	std::vector<Block> blocks;
+	bool loaded = false;	///< read from the index file, rather than built while reading the .pbf
+
+	/// Load the index for a .pbf file; returns false if there isn't a valid one
+	bool load(std::string const &pbfFile);
+
+	/// Save the index next to the .pbf file; returns false if it couldn't be written
+	bool save(std::string const &pbfFile) const;
+
+	static std::string indexFile(std::string const &pbfFile) { return pbfFile + ".index"; }
+};
+
+#endif //_PBF_INDEX_H
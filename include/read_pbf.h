@@ -6,7 +6,12 @@
 #include <unordered_set>
 #include <vector>
 #include <map>
+#include <memory>
+#include <mutex>
 #include "osm_store.h"
+#include "pbf_decoder.h"
+#include "tag_list.h"
+#include "pbf_index.h"
 
 // Protobuf
 #include "osmformat.pb.h"
@@ -14,6 +19,42 @@
 
 class OsmLuaProcessing;
 
+/**
+ *\brief Keeps decoded PrimitiveBlocks between read phases
+ *
+ * Each blob is inflated and parsed once; if a later phase still needs it and it fits
+ * within the memory budget, the parsed block is kept here. Blocks that don't fit are
+ * simply decoded again when the next phase reaches them.
+ */
+class PbfBlockCache
+{
+public:
+	using block_ptr = std::shared_ptr<PbfPrimitiveBlock const>;
+
+	PbfBlockCache(std::size_t maxSize)
+		: maxSize(maxSize)
+	{ }
+
+	// Return the cached block, or nullptr if it has not been kept
+	block_ptr get(std::size_t index) const;
+
+	// Keep a block if it fits within the budget
+	bool put(std::size_t index, block_ptr const &block, std::size_t blockSize);
+
+	void erase(std::size_t index);
+
+	std::size_t size() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return usedSize;
+	}
+
+private:
+	mutable std::mutex mutex;
+	std::map<std::size_t, std::pair<block_ptr, std::size_t>> blocks;
+	std::size_t usedSize = 0;
+	std::size_t maxSize;
+};
+
 /**
  *\brief Reads a PBF OSM file and returns objects as a stream of events to a class derived from OsmLuaProcessing
  *
@@ -22,41 +63,105 @@ class OsmLuaProcessing;
 class PbfReader
 {
 public:	
-	enum class ReadPhase { Nodes = 1, Ways = 2, Relations = 4, RelationScan = 8, All = 15 };
+	enum class ReadPhase { Nodes = 1, Ways = 2, Relations = 4, RelationScan = 8, WayScan = 16, All = 31 };
 
 	PbfReader(OSMStore &osmStore);
+	~PbfReader();
+
+	// Set the memory budget (in bytes) for decoded blocks kept between phases
+	void setBlockCacheSize(std::size_t bytes) { blockCacheSize = bytes; }
+
+	// Scan the ways before reading nodes, and only store the nodes they use
+	void setOnlyUsedNodes(bool only) { onlyUsedNodes = only; }
+
+	// Only pass ways/relations with at least one of these keys to Lua (no filtering if empty)
+	void setWayKeys(std::unordered_set<std::string> const &keys) { wayKeys = keys; }
+	void setRelationKeys(std::unordered_set<std::string> const &keys) { relationKeys = keys; }
 
 	using pbfreader_generate_output = std::function< std::unique_ptr<OsmLuaProcessing> () >;
-	using pbfreader_generate_stream = std::function< std::unique_ptr<std::istream> () >;
 
+	// Read a whole .pbf held in memory (typically a read-only mapping of the file).
+	// Blocks are parsed in place, so the buffer must stay valid until this returns.
+	// If index has blocks, they are used instead of scanning the file; otherwise
+	// (unless it is nullptr) it is filled in as the file is read.
 	int ReadPbfFile(std::unordered_set<std::string> const &nodeKeys, unsigned int threadNum, 
-			pbfreader_generate_stream const &generate_stream,
+			char const *data, std::size_t size, PbfBlockIndex *index,
 			pbfreader_generate_output const &generate_output);
 
-	// Read tags into a map from a way/node/relation
-	using tag_map_t = boost::container::flat_map<std::string, std::string>;
+	// Destroy the processing contexts kept between files (runs each Lua exit_function)
+	void ClearOutputs();
+
+	// Read tags from a way/relation into a TagList
 	template<typename T>
-	void readTags(T &pbfObject, PrimitiveBlock const &pb, tag_map_t &tags) {
-		auto keysPtr = pbfObject.mutable_keys();
-		auto valsPtr = pbfObject.mutable_vals();
-		for (uint n=0; n < pbfObject.keys_size(); n++) {
-			tags[pb.stringtable().s(keysPtr->Get(n))] = pb.stringtable().s(valsPtr->Get(n));
+	void readTags(T const &pbfObject, BlockTagKeys &keys, TagList &tags) {
+		PbfStringTable const &strings = keys.stringTable();
+		tags.clear();
+		auto val = pbfObject.vals.begin(), valEnd = pbfObject.vals.end();
+		for (uint32_t key : pbfObject.keys) {
+			if (val == valEnd) break;
+			tags.add(keys(key), strings[key], strings[*val]);
+			++val;
 		}
 	}
 
 private:
-	bool ReadBlock(std::istream &infile, OsmLuaProcessing &output, std::pair<std::size_t, std::size_t> progress, std::size_t datasize, 
-	               std::unordered_set<std::string> const &nodeKeys, bool locationsOnWays, ReadPhase phase = ReadPhase::All);
-	bool ReadNodes(OsmLuaProcessing &output, PrimitiveGroup &pg, PrimitiveBlock const &pb, const std::unordered_set<int> &nodeKeyPositions);
+	/// Positions in a block's string table of the keys that make an object worth processing.
+	/// An inactive filter lets everything through.
+	struct KeyFilter {
+		bool active = false;
+		std::unordered_set<int> positions;
+
+		template<typename T>
+		bool matches(T const &pbfObject) const {
+			if (!active) return true;
+			for (uint32_t key : pbfObject.keys) {
+				if (positions.find(key) != positions.end()) return true;
+			}
+			return false;
+		}
+	};
+	static KeyFilter keyFilter(PbfPrimitiveBlock const &pb, std::unordered_set<std::string> const &keys);
+
+	void ReadBlock(PbfPrimitiveBlock const &pb, OsmLuaProcessing &output, std::pair<std::size_t, std::size_t> progress, 
+	               std::unordered_set<std::string> const &nodeKeys, bool locationsOnWays, bool usedNodesOnly, ReadPhase phase = ReadPhase::All);
+	bool ReadNodes(OsmLuaProcessing &output, PbfPrimitiveGroup const &pg, PbfPrimitiveBlock const &pb, std::size_t segment, BlockTagKeys &keys, const std::unordered_set<int> &nodeKeyPositions, bool locationsOnWays, bool usedNodesOnly);
+	void ReadSignificantNodes(OsmLuaProcessing &output, PbfPrimitiveGroup const &pg, BlockTagKeys &keys, const std::unordered_set<int> &nodeKeyPositions);
+	/// Step over one dense node's tags, which are (key, value)* 0 in keys_vals; if any key is
+	/// significant, read them all into tags and return true
+	static bool readDenseTags(PbfPackedInt32::const_iterator &kv, PbfPackedInt32::const_iterator kvEnd, BlockTagKeys &keys, const std::unordered_set<int> &nodeKeyPositions, TagList &tags);
 
-	bool ReadWays(OsmLuaProcessing &output, PrimitiveGroup &pg, PrimitiveBlock const &pb, bool locationsOnWays);
-	bool ScanRelations(OsmLuaProcessing &output, PrimitiveGroup &pg, PrimitiveBlock const &pb);
-	bool ReadRelations(OsmLuaProcessing &output, PrimitiveGroup &pg, PrimitiveBlock const &pb);
+	bool ScanWays(PbfPrimitiveGroup const &pg);
+
+	bool ReadWays(OsmLuaProcessing &output, PbfPrimitiveGroup const &pg, PbfPrimitiveBlock const &pb, std::size_t segment, BlockTagKeys &keys, bool locationsOnWays, KeyFilter const &wayFilter);
+	bool ScanRelations(OsmLuaProcessing &output, PbfPrimitiveGroup const &pg, PbfPrimitiveBlock const &pb, BlockTagKeys &keys, KeyFilter const &relationFilter);
+	bool ReadRelations(OsmLuaProcessing &output, PbfPrimitiveGroup const &pg, PbfPrimitiveBlock const &pb, std::size_t segment, BlockTagKeys &keys, KeyFilter const &wayFilter, KeyFilter const &relationFilter);
+
+	/// Take an idle processing context from the pool, creating one if there is none
+	OsmLuaProcessing &acquireOutput(pbfreader_generate_output const &generate_output);
+	void releaseOutput(OsmLuaProcessing &output);
+
+	/// Whether every block in a loaded index still has its header where the index says
+	static bool indexMatches(PbfBlockIndex const &index, char const *data, std::size_t size);
+
+	/// Which read phases have something to do in this block (a mask of ReadPhase values)
+	static unsigned int blockPhases(PbfPrimitiveBlock const &pb);
+
+	/// Fault in the pages of a block in a memory-mapped file
+	static void pageIn(char const *data, std::size_t length);
 
 	/// Find a string in the dictionary
-	static int findStringPosition(PrimitiveBlock const &pb, char const *str);
+	static int findStringPosition(PbfPrimitiveBlock const &pb, char const *str);
 	
 	OSMStore &osmStore;
+	std::size_t blockCacheSize;
+	bool onlyUsedNodes;
+	std::unordered_set<std::string> wayKeys, relationKeys;
+
+	// Lua processing contexts are expensive to start, so each one is reused
+	// for many blocks. At most one is created per concurrently running task.
+	std::mutex outputsMutex;
+	std::vector<std::unique_ptr<OsmLuaProcessing>> outputs;
+	std::vector<OsmLuaProcessing *> idleOutputs;
 };
 
 int ReadPbfBoundingBox(const std::string &inputFile, double &minLon, double &maxLon, 
@@ -29,7 +29,7 @@ public:
 	}
 	std::vector<uint> QueryMatchingGeometries(const std::string &layerName, bool once, Box &box, 
 		std::function<std::vector<IndexValue>(const RTree &rtree)> indexQuery, 
-		std::function<bool(OutputObject const &oo)> checkQuery) const;
+		std::function<bool(OutputObject const &oo, MultiPolygon const &mp)> checkQuery) const;
 	std::vector<std::string> namesOfGeometries(const std::vector<uint> &ids) const;
 
 	template <typename GeometryT>
@@ -46,7 +46,7 @@ public:
 		for (auto it : results) {
 			OutputObjectRef oo = cachedGeometries.at(it.second);
 			if (oo->geomType!=POLYGON_) continue;
-			geom::union_(mp, osmStore.retrieve_multi_polygon(osmStore.shp(), oo->objectID), tmp);
+			geom::union_(mp, expandedPolygon(*oo), tmp);
 			geom::assign(mp, tmp);
 		}
 		geom::correct(mp);
@@ -54,6 +54,9 @@ public:
 	}
 
 private:
+	/// Expand a stored polygon for a spatial query; valid until this thread's next call
+	MultiPolygon const &expandedPolygon(OutputObject const &oo) const;
+
 	/// Add an OutputObject to all tiles between min/max lat/lon
 	void addToTileIndexByBbox(OutputObjectRef &oo, 
 		double minLon, double minLatp, double maxLon, double maxLatp);
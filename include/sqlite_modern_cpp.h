@@ -39,6 +39,12 @@ namespace sqlite {
 	class database;
 	class database_binder;
 
+	// A blob column read in place rather than copied; only valid inside the callback it's passed to
+	struct blob_view {
+		char const *data = nullptr;
+		std::size_t size = 0;
+	};
+
 	template<int N>
 	class binder {
 		template<typename F>
@@ -169,6 +175,13 @@ namespace sqlite {
 				v = std::vector<char>(p, p+size);
 			}
 		}
+		void get_col_from_db(int inx, blob_view& b) {
+			if (sqlite3_column_type(_stmt, inx) == SQLITE_NULL) b = blob_view();
+			else {
+				b.size = sqlite3_column_bytes(_stmt, inx);
+				b.data = (char const*)sqlite3_column_blob(_stmt, inx);
+			}
+		}
 		void get_col_from_db(int inx, double& d) {
 			if (sqlite3_column_type(_stmt, inx) == SQLITE_NULL) d = 0;
 			else d = sqlite3_column_double(_stmt, inx);
@@ -0,0 +1,89 @@
+/*! \file */
+#ifndef _TAG_LIST_H
+#define _TAG_LIST_H
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/container/flat_map.hpp>
+#include "pbf_decoder.h"
+
+/**
+ *\brief Gives each distinct tag key a small integer ID
+ *
+ * IDs are shared by all threads, so tags can be matched by key without comparing strings.
+ */
+class TagKeys {
+public:
+	static uint32_t intern(std::string const &key);
+
+private:
+	static std::mutex mutex;
+	static std::unordered_map<std::string, uint32_t> ids;
+};
+
+/**
+ *\brief The tags of the OSM object being processed
+ *
+ * Keys are interned IDs, and key/value strings point into the string table of the
+ * block being read, so refilling the list allocates nothing once it has grown.
+ */
+class TagList {
+public:
+	using tag_map_t = boost::container::flat_map<std::string, std::string>;
+
+	struct Tag {
+		uint32_t key;
+		PbfSlice keyString;
+		PbfSlice value;
+	};
+	using const_iterator = std::vector<Tag>::const_iterator;
+
+	void clear() { tags.clear(); }
+	void add(uint32_t key, PbfSlice keyString, PbfSlice value) { tags.push_back({ key, keyString, value }); }
+
+	// Value for a key, or nullptr if the object doesn't have it
+	PbfSlice const *find(uint32_t key) const {
+		for (Tag const &tag : tags) {
+			if (tag.key == key) return &tag.value;
+		}
+		return nullptr;
+	}
+
+	bool empty() const { return tags.empty(); }
+	std::size_t size() const { return tags.size(); }
+	const_iterator begin() const { return tags.begin(); }
+	const_iterator end() const { return tags.end(); }
+
+	// Copy into a map of strings, for the few callers that need one
+	tag_map_t toMap() const;
+
+private:
+	std::vector<Tag> tags;
+};
+
+/// Interned key IDs for the string table of one block, each looked up the first time it is used
+class BlockTagKeys {
+public:
+	BlockTagKeys(PbfStringTable const &strings)
+		: strings(strings), ids(strings.size(), unknown)
+	{ }
+
+	uint32_t operator()(uint32_t position) {
+		uint32_t &id = ids.at(position);
+		if (id == unknown) id = TagKeys::intern(strings.str(position));
+		return id;
+	}
+
+	PbfStringTable const &stringTable() const { return strings; }
+
+private:
+	enum : uint32_t { unknown = 0xffffffff };
+
+	PbfStringTable const &strings;
+	std::vector<uint32_t> ids;
+};
+
+#endif //_TAG_LIST_H
@@ -5,6 +5,7 @@
 #include <iomanip>
 #include <sstream>
 #include <cstring>
+#include <algorithm>
 
 #define MOD_GZIP_ZLIB_WINDOWSIZE 15
 #define MOD_GZIP_ZLIB_CFACTOR 9
@@ -13,100 +14,130 @@
 namespace geom = boost::geometry;
 using namespace std;
 
-// zlib routines from http://panthema.net/2007/0328-ZLibString.html
+// zlib routines, originally from http://panthema.net/2007/0328-ZLibString.html
 
-// Compress a STL string using zlib with given compression level, and return the binary data
-std::string compress_string(const std::string& str,
-                            int compressionlevel,
-                            bool asGzip) {
-    z_stream zs;                        // z_stream is zlib's control structure
-    memset(&zs, 0, sizeof(zs));
-
-	if (asGzip) {
-		if (deflateInit2(&zs, compressionlevel, Z_DEFLATED,
-		                MOD_GZIP_ZLIB_WINDOWSIZE + 16, MOD_GZIP_ZLIB_CFACTOR, Z_DEFAULT_STRATEGY) != Z_OK)
-	        throw(std::runtime_error("deflateInit2 failed while compressing."));
-	} else {
-	    if (deflateInit(&zs, compressionlevel) != Z_OK)
-	        throw(std::runtime_error("deflateInit failed while compressing."));
-	}
-
-    zs.next_in = (Bytef*)str.data();
-    zs.avail_in = str.size();           // set the z_stream's input
-
-    int ret;
-    char outbuffer[32768];
-    std::string outstring;
-
-    // retrieve the compressed bytes blockwise
-    do {
-        zs.next_out = reinterpret_cast<Bytef*>(outbuffer);
-        zs.avail_out = sizeof(outbuffer);
-
-        ret = deflate(&zs, Z_FINISH);
-
-        if (outstring.size() < zs.total_out) {
-            // append the block to the output string
-            outstring.append(outbuffer,
-                             zs.total_out - outstring.size());
-        }
-    } while (ret == Z_OK);
-
-    deflateEnd(&zs);
-
-    if (ret != Z_STREAM_END) {          // an error occurred that was not EOF
-        std::ostringstream oss;
-        oss << "Exception during zlib compression: (" << ret << ") " << zs.msg;
-        throw(std::runtime_error(oss.str()));
-    }
+ZlibContext::ZlibContext()
+	: inflaterInited(false), gzipInflaterInited(false), deflaterInited(false), deflateLevel(0), deflateGzip(false) {
+	memset(&inflater, 0, sizeof(inflater));
+	memset(&gzipInflater, 0, sizeof(gzipInflater));
+	memset(&deflater, 0, sizeof(deflater));
+}
 
-    return outstring;
+ZlibContext::~ZlibContext() {
+	if (inflaterInited) inflateEnd(&inflater);
+	if (gzipInflaterInited) inflateEnd(&gzipInflater);
+	if (deflaterInited) deflateEnd(&deflater);
 }
 
-// Decompress an STL string using zlib and return the original data.
-std::string decompress_string(const std::string& str, bool asGzip) {
-    z_stream zs;                        // z_stream is zlib's control structure
-    memset(&zs, 0, sizeof(zs));
+ZlibContext &ZlibContext::forThread() {
+	static thread_local ZlibContext context;
+	return context;
+}
 
-	if (asGzip) {
-		if (inflateInit2(&zs, 16+MAX_WBITS) != Z_OK)
-			throw(std::runtime_error("inflateInit2 failed while decompressing."));
+// Decompress into out (replacing its contents). If the uncompressed size is known,
+// out is sized for it up front, so it is written in one go with no reallocation.
+void ZlibContext::decompress(const char *data, std::size_t size, std::string &out, bool asGzip, std::size_t expectedSize) {
+	z_stream &zs = asGzip ? gzipInflater : inflater;
+	bool &inited = asGzip ? gzipInflaterInited : inflaterInited;
+	if (!inited) {
+		if (asGzip) {
+			if (inflateInit2(&zs, 16+MAX_WBITS) != Z_OK)
+				throw(std::runtime_error("inflateInit2 failed while decompressing."));
+		} else {
+			if (inflateInit(&zs) != Z_OK)
+				throw(std::runtime_error("inflateInit failed while decompressing."));
+		}
+		inited = true;
 	} else {
-		if (inflateInit(&zs) != Z_OK)
-			throw(std::runtime_error("inflateInit failed while decompressing."));
+		inflateReset(&zs);
 	}
 
-    zs.next_in = (Bytef*)str.data();
-    zs.avail_in = str.size();
-
-    int ret;
-    char outbuffer[32768];
-    std::string outstring;
-
-    // get the decompressed bytes blockwise using repeated calls to inflate
-    do {
-        zs.next_out = reinterpret_cast<Bytef*>(outbuffer);
-        zs.avail_out = sizeof(outbuffer);
-
-        ret = inflate(&zs, 0);
+	zs.next_in = (Bytef*)data;
+	zs.avail_in = size;
+
+	out.resize(expectedSize > 0 ? expectedSize : std::max<std::size_t>(size * 4, 32768));
+	std::size_t written = 0;
+	int ret;
+	do {
+		if (written == out.size()) { out.resize(out.size() * 2); }
+		zs.next_out = reinterpret_cast<Bytef*>(&out[written]);
+		zs.avail_out = out.size() - written;
+		ret = inflate(&zs, Z_NO_FLUSH);
+		written = out.size() - zs.avail_out;
+	} while (ret == Z_OK);
+	out.resize(written);
+
+	if (ret != Z_STREAM_END) {          // an error occurred that was not EOF
+		std::ostringstream oss;
+		oss << "Exception during zlib decompression: (" << ret << ") " << (zs.msg ? zs.msg : "");
+		throw(std::runtime_error(oss.str()));
+	}
+}
 
-        if (outstring.size() < zs.total_out) {
-            outstring.append(outbuffer,
-                             zs.total_out - outstring.size());
-        }
+// Compress into out (replacing its contents)
+void ZlibContext::compress(const char *data, std::size_t size, std::string &out, int compressionlevel, bool asGzip) {
+	// The level and header are fixed when the stream is set up, so only reuse it if they match
+	if (deflaterInited && (compressionlevel != deflateLevel || asGzip != deflateGzip)) {
+		deflateEnd(&deflater);
+		memset(&deflater, 0, sizeof(deflater));
+		deflaterInited = false;
+	}
+	if (!deflaterInited) {
+		if (asGzip) {
+			if (deflateInit2(&deflater, compressionlevel, Z_DEFLATED,
+			                 MOD_GZIP_ZLIB_WINDOWSIZE + 16, MOD_GZIP_ZLIB_CFACTOR, Z_DEFAULT_STRATEGY) != Z_OK)
+				throw(std::runtime_error("deflateInit2 failed while compressing."));
+		} else {
+			if (deflateInit(&deflater, compressionlevel) != Z_OK)
+				throw(std::runtime_error("deflateInit failed while compressing."));
+		}
+		deflaterInited = true;
+		deflateLevel = compressionlevel;
+		deflateGzip = asGzip;
+	} else {
+		deflateReset(&deflater);
+	}
 
-    } while (ret == Z_OK);
+	deflater.next_in = (Bytef*)data;
+	deflater.avail_in = size;           // set the z_stream's input
+
+	out.resize(deflateBound(&deflater, size) + 32);
+	std::size_t written = 0;
+	int ret;
+	do {
+		if (written == out.size()) { out.resize(out.size() * 2); }
+		deflater.next_out = reinterpret_cast<Bytef*>(&out[written]);
+		deflater.avail_out = out.size() - written;
+		ret = deflate(&deflater, Z_FINISH);
+		written = out.size() - deflater.avail_out;
+	} while (ret == Z_OK);
+	out.resize(written);
+
+	if (ret != Z_STREAM_END) {          // an error occurred that was not EOF
+		std::ostringstream oss;
+		oss << "Exception during zlib compression: (" << ret << ") " << (deflater.msg ? deflater.msg : "");
+		throw(std::runtime_error(oss.str()));
+	}
+}
 
-    inflateEnd(&zs);
+// Compress a STL string using zlib with given compression level, and return the binary data
+std::string compress_string(const std::string& str,
+                            int compressionlevel,
+                            bool asGzip) {
+	std::string outstring;
+	ZlibContext::forThread().compress(str.data(), str.size(), outstring, compressionlevel, asGzip);
+	return outstring;
+}
 
-    if (ret != Z_STREAM_END) {          // an error occurred that was not EOF
-        std::ostringstream oss;
-        oss << "Exception during zlib decompression: (" << ret << ") "
-            << zs.msg;
-        throw(std::runtime_error(oss.str()));
-    }
+// Decompress an STL string using zlib and return the original data.
+std::string decompress_string(const std::string& str, bool asGzip) {
+	return decompress_string(str.data(), str.size(), asGzip);
+}
 
-    return outstring;
+std::string decompress_string(const char *data, std::size_t size, bool asGzip) {
+	std::string outstring;
+	ZlibContext::forThread().decompress(data, size, outstring, asGzip);
+	return outstring;
 }
 
 // Parse a Boost error
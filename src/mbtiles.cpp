@@ -72,10 +72,10 @@ void MBTiles::readTileList(std::vector<std::tuple<int,int,int>> &tileList) {
 	};
 }
 
-vector<char> MBTiles::readTile(int zoom, int col, int row) {
-	vector<char> pbfBlob;
-	db << "SELECT tile_data FROM tiles WHERE zoom_level=? AND tile_column=? AND tile_row=?" << zoom << col << row >> pbfBlob;
-	return pbfBlob;
+void MBTiles::readTile(int zoom, int col, int row, std::function<void(char const *data, std::size_t size)> const &process) {
+	db << "SELECT tile_data FROM tiles WHERE zoom_level=? AND tile_column=? AND tile_row=?" << zoom << col << row >> [&](sqlite::blob_view pbfBlob) {
+		process(pbfBlob.data, pbfBlob.size);
+	};
 }
 
 bool MBTiles::readTileAndUncompress(string &data, int zoom, int x, int y, bool isCompressed, bool asGzip) {
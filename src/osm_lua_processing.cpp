@@ -6,6 +6,7 @@
 using namespace std;
 
 thread_local kaguya::State *g_luaState = nullptr;
+static const TagList noTags;
 bool supportsRemappingShapefiles = false;
 
 int lua_error_handler(int errCode, const char *errMessage)
@@ -32,6 +33,8 @@ OsmLuaProcessing::OsmLuaProcessing(
 	config(configIn),
 	layers(layers) {
 
+	currentTags = &noTags;
+
 	// ----	Initialise Lua
 	g_luaState = &luaState;
 	luaState.setErrorHandler(lua_error_handler);
@@ -74,9 +77,27 @@ OsmLuaProcessing::OsmLuaProcessing(
 
 OsmLuaProcessing::~OsmLuaProcessing() {
 	// Call exit_function of Lua logic
+	g_luaState = &luaState;
 	luaState("if exit_function~=nil then exit_function() end");
 }
 
+// Clear cached state before processing the next object. The same instance
+// is reused for many blocks, possibly on different threads, so also make
+// this the Lua state used by the error handler on the current thread.
+void OsmLuaProcessing::reset() {
+	g_luaState = &luaState;
+	outputs.clear();
+	llVecPtr = nullptr;
+	outerWayVecPtr = nullptr;
+	innerWayVecPtr = nullptr;
+	linestringInited = false;
+	multiLinestringInited = false;
+	polygonInited = false;
+	multiPolygonInited = false;
+	relationAccepted = false;
+	relationSubscript = -1;
+}
+
 // ----	Helpers provided for main routine
 
 // Has this object been assigned to any layers?
@@ -112,16 +133,25 @@ string OsmLuaProcessing::Id() const {
 	return to_string(originalOsmID);
 }
 
+// Interned ID for a key, remembered so that Lua lookups don't go to the shared table
+uint32_t OsmLuaProcessing::keyId(const string& key) const {
+	auto it = keyIds.find(key);
+	if (it != keyIds.end()) return it->second;
+	uint32_t id = TagKeys::intern(key);
+	keyIds.emplace(key, id);
+	return id;
+}
+
 // Check if there's a value for a given key
 bool OsmLuaProcessing::Holds(const string& key) const {
-	return currentTags.find(key) != currentTags.end();
+	return currentTags->find(keyId(key)) != nullptr;
 }
 
 // Get an OSM tag for a given key (or return empty string if none)
 string OsmLuaProcessing::Find(const string& key) const {
-	auto it = currentTags.find(key);
-	if(it == currentTags.end()) return "";
-	return it->second;
+	PbfSlice const *value = currentTags->find(keyId(key));
+	if (!value) return "";
+	return value->str();
 }
 
 #ifdef TRIM_NAME_WHITESPACE
@@ -133,9 +163,10 @@ using namespace boost::algorithm;
 // store all the names, return name count
 string OsmLuaProcessing::GetMultilingualName() const {
   string _nameml = "";
+  TagList::tag_map_t tags = currentTags->toMap();
   // look for base name
-  auto it = currentTags.find("name");
-  if (it != currentTags.end()) { // has base name
+  auto it = tags.find("name");
+  if (it != tags.end()) { // has base name
     // store base name
 #ifdef TRIM_NAME_WHITESPACE
     string basename = it->second;
@@ -148,7 +179,7 @@ string OsmLuaProcessing::GetMultilingualName() const {
     //    this->Attribute(it->first,basename);
     //    cout << "base_name: " << basename << "--\n";
 
-    for(auto it=currentTags.begin(); it!=currentTags.end(); ++it) {
+    for(auto it=tags.begin(); it!=tags.end(); ++it) {
       auto tag = it->first;
       if (tag.find("name:") == 0) {
         transform(tag.begin(), tag.end(), tag.begin(), ::tolower);// make case consistent - lower
@@ -224,8 +255,8 @@ std::vector<uint> OsmLuaProcessing::intersectsQuery(const string &layerName, boo
 			rtree.query(geom::index::intersects(box), back_inserter(results));
 			return results;
 		},
-		[&](OutputObject const &oo) { // checkQuery
-			return geom::intersects(geom, osmStore.retrieve_multi_polygon(osmStore.shp(), oo.objectID));
+		[&](OutputObject const &oo, MultiPolygon const &mp) { // checkQuery
+			return geom::intersects(geom, mp);
 		}
 	);
 	return ids;
@@ -241,9 +272,9 @@ double OsmLuaProcessing::intersectsArea(const string &layerName, GeometryT &geom
 			rtree.query(geom::index::intersects(box), back_inserter(results));
 			return results;
 		},
-		[&](OutputObject const &oo) { // checkQuery
+		[&](OutputObject const &oo, MultiPolygon const &mp) { // checkQuery
 			MultiPolygon tmp;
-			geom::intersection(geom, osmStore.retrieve_multi_polygon(osmStore.shp(), oo.objectID), tmp);
+			geom::intersection(geom, mp, tmp);
 			area += multiPolygonArea(tmp);
 			return false;
 		}
@@ -260,9 +291,8 @@ std::vector<uint> OsmLuaProcessing::coveredQuery(const string &layerName, bool o
 			rtree.query(geom::index::intersects(box), back_inserter(results));
 			return results;
 		},
-		[&](OutputObject const &oo) { // checkQuery
-			if (oo.geomType!=POLYGON_) return false; // can only be covered by a polygon!
-			return geom::covered_by(geom, osmStore.retrieve_multi_polygon(osmStore.shp(), oo.objectID));
+		[&](OutputObject const &oo, MultiPolygon const &mp) { // checkQuery
+			return geom::covered_by(geom, mp);
 		}
 	);
 	return ids;
@@ -381,9 +411,9 @@ void OsmLuaProcessing::Layer(const string &layerName, bool area) {
 
             if(!CorrectGeometry(p)) return;
 
-			osmStore.store_point(osmStore.osm(), osmID, p);
+			OSMStore::handle_t handle = osmStore.store_point(osmStore.osm(), p);
 			OutputObjectRef oo = osmMemTiles.CreateObject(OutputObjectOsmStorePoint(geomType, 
-							layers.layerMap[layerName], osmID, attributeStore.empty_set(), layerMinZoom));
+							layers.layerMap[layerName], osmID, handle, attributeStore.empty_set(), layerMinZoom));
 			outputs.push_back(std::make_pair(oo, attributeStore.empty_set()));
             return;
 		}
@@ -411,9 +441,9 @@ void OsmLuaProcessing::Layer(const string &layerName, bool area) {
 
             if(!CorrectGeometry(mp)) return;
 
-			osmStore.store_multi_polygon(osmStore.osm(), osmID, mp);
+			OSMStore::handle_t handle = osmStore.store_multi_polygon(osmStore.osm(), mp);
 			OutputObjectRef oo = osmMemTiles.CreateObject(OutputObjectOsmStoreMultiPolygon(geomType, 
-							layers.layerMap[layerName], osmID, attributeStore.empty_set(), layerMinZoom));
+							layers.layerMap[layerName], osmID, handle, attributeStore.empty_set(), layerMinZoom));
 			outputs.push_back(std::make_pair(oo, attributeStore.empty_set()));
 		}
 		else if (geomType==MULTILINESTRING_) {
@@ -427,9 +457,9 @@ void OsmLuaProcessing::Layer(const string &layerName, bool area) {
 			}
 			if (!CorrectGeometry(mls)) return;
 
-			osmStore.store_multi_linestring(osmStore.osm(), osmID, mls);
+			OSMStore::handle_t handle = osmStore.store_multi_linestring(osmStore.osm(), mls);
 			OutputObjectRef oo = osmMemTiles.CreateObject(OutputObjectOsmStoreMultiLinestring(geomType, 
-							layers.layerMap[layerName], osmID, attributeStore.empty_set(), layerMinZoom));
+							layers.layerMap[layerName], osmID, handle, attributeStore.empty_set(), layerMinZoom));
 			outputs.push_back(std::make_pair(oo, attributeStore.empty_set()));
 		}
 		else if (geomType==LINESTRING_) {
@@ -438,9 +468,9 @@ void OsmLuaProcessing::Layer(const string &layerName, bool area) {
 
             if(!CorrectGeometry(ls)) return;
 
-			osmStore.store_linestring(osmStore.osm(), osmID, ls);
+			OSMStore::handle_t handle = osmStore.store_linestring(osmStore.osm(), ls);
 			OutputObjectRef oo = osmMemTiles.CreateObject(OutputObjectOsmStoreLinestring(geomType, 
-						layers.layerMap[layerName], osmID, attributeStore.empty_set(), layerMinZoom));
+						layers.layerMap[layerName], osmID, handle, attributeStore.empty_set(), layerMinZoom));
 			outputs.push_back(std::make_pair(oo, attributeStore.empty_set()));
 		}
 	} catch (std::invalid_argument &err) {
@@ -473,9 +503,9 @@ void OsmLuaProcessing::LayerAsCentroid(const string &layerName) {
 		return;
 	}
 
-	osmStore.store_point(osmStore.osm(), osmID, geomp);
+	OSMStore::handle_t handle = osmStore.store_point(osmStore.osm(), geomp);
 	OutputObjectRef oo = osmMemTiles.CreateObject(OutputObjectOsmStorePoint(POINT_,
-					layers.layerMap[layerName], osmID, attributeStore.empty_set(), layerMinZoom));
+					layers.layerMap[layerName], osmID, handle, attributeStore.empty_set(), layerMinZoom));
 	outputs.push_back(std::make_pair(oo, attributeStore.empty_set()));
 }
 
@@ -587,12 +617,12 @@ void OsmLuaProcessing::setVectorLayerMetadata(const uint_least8_t layer, const s
 
 // Scan relation (but don't write geometry)
 // return true if we want it, false if we don't
-bool OsmLuaProcessing::scanRelation(WayID id, const tag_map_t &tags) {
+bool OsmLuaProcessing::scanRelation(WayID id, const TagList &tags) {
 	reset();
 	originalOsmID = id;
 	isWay = false;
 	isRelation = true;
-	currentTags = tags;
+	currentTags = &tags;
 	luaState["relation_scan_function"](this);
 	if (!relationAccepted) return false;
 	
@@ -600,7 +630,7 @@ bool OsmLuaProcessing::scanRelation(WayID id, const tag_map_t &tags) {
 	return true;
 }
 
-void OsmLuaProcessing::setNode(NodeID id, LatpLon node, const tag_map_t &tags) {
+void OsmLuaProcessing::setNode(NodeID id, LatpLon node, const TagList &tags) {
 
 	reset();
 	osmID = (id & OSMID_MASK) | OSMID_NODE;
@@ -609,7 +639,7 @@ void OsmLuaProcessing::setNode(NodeID id, LatpLon node, const tag_map_t &tags) {
 	isRelation = false;
 	lon = node.lon;
 	latp= node.latp;
-	currentTags = tags;
+	currentTags = &tags;
 
 	//Start Lua processing for node
 	luaState["node_function"](this);
@@ -627,7 +657,7 @@ void OsmLuaProcessing::setNode(NodeID id, LatpLon node, const tag_map_t &tags) {
 }
 
 // We are now processing a way
-void OsmLuaProcessing::setWay(WayID wayId, LatpLonVec const &llVec, const tag_map_t &tags) {
+void OsmLuaProcessing::setWay(WayID wayId, LatpLonVec const &llVec, const TagList &tags) {
 	reset();
 	osmID = (wayId & OSMID_MASK) | OSMID_WAY;
 	originalOsmID = wayId;
@@ -641,7 +671,7 @@ void OsmLuaProcessing::setWay(WayID wayId, LatpLonVec const &llVec, const tag_ma
 	if (supportsReadingRelations && osmStore.way_in_any_relations(wayId)) {
 		relationList = osmStore.relations_for_way(wayId);
 	} else {
-		relationList.clear();
+		relationList = RelationScanStore::relation_list_t();
 	}
 
 	try {
@@ -653,7 +683,7 @@ void OsmLuaProcessing::setWay(WayID wayId, LatpLonVec const &llVec, const tag_ma
 		throw std::out_of_range(ss.str());
 	}
 
-	currentTags = tags;
+	currentTags = &tags;
 
 	bool ok = true;
 	if (ok) {
@@ -725,7 +755,7 @@ void OsmLuaProcessing::setWay(WayID wayId, LatpLonVec const &llVec, const tag_ma
 // We are now processing a relation
 // (note that we store relations as ways with artificial IDs, and that
 //  we use decrementing positive IDs to give a bit more space for way IDs)
-void OsmLuaProcessing::setRelation(int64_t relationId, WayVec const &outerWayVec, WayVec const &innerWayVec, const tag_map_t &tags, bool isNativeMP) {
+void OsmLuaProcessing::setRelation(int64_t relationId, WayVec const &outerWayVec, WayVec const &innerWayVec, const TagList &tags, bool isNativeMP) {
 	reset();
 	osmID = (relationId & OSMID_MASK) | OSMID_RELATION;
 	originalOsmID = relationId;
@@ -736,7 +766,7 @@ void OsmLuaProcessing::setRelation(int64_t relationId, WayVec const &outerWayVec
 	llVecPtr = nullptr;
 	outerWayVecPtr = &outerWayVec;
 	innerWayVecPtr = &innerWayVec;
-	currentTags = tags;
+	currentTags = &tags;
 
 	bool ok = true;
 	if (ok) {
@@ -833,3 +863,14 @@ vector<string> OsmLuaProcessing::GetSignificantNodeKeys() {
 	return luaState["node_keys"];
 }
 
+// way_keys and relation_keys are optional; without them every way/relation is processed
+vector<string> OsmLuaProcessing::GetSignificantWayKeys() {
+	if (!luaState["way_keys"]) return vector<string>();
+	return luaState["way_keys"];
+}
+
+vector<string> OsmLuaProcessing::GetSignificantRelationKeys() {
+	if (!luaState["relation_keys"]) return vector<string>();
+	return luaState["relation_keys"];
+}
+
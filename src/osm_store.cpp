@@ -1,104 +1,212 @@
 
 #include "osm_store.h"
+#include <algorithm>
+#include <array>
 #include <iostream>
 #include <fstream>
 #include <iterator>
+#include <limits>
+#include <map>
 #include <unordered_map>
 
+#include <boost/interprocess/anonymous_shared_memory.hpp>
 #include <boost/interprocess/mapped_region.hpp>
-#include <boost/interprocess/managed_external_buffer.hpp>
 #include <boost/interprocess/file_mapping.hpp>
 
 #include <ciso646>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#define TM_POSIX_MMAP
+#endif
 #include <boost/filesystem.hpp>
 #include <boost/sort/sort.hpp>
 
 using namespace std;
 namespace bg = boost::geometry;
 
-struct mmap_file
+// A chunk of mapped memory that allocations are carved from
+struct mmap_chunk
 {
-	std::string filename;
-
-	std::mutex mutex;
+	std::string filename;		// backing file, or empty for anonymous memory
 	boost::interprocess::file_mapping mapping;
 	boost::interprocess::mapped_region region;
-	boost::interprocess::managed_external_buffer buffer;
+	uint8_t *data = nullptr;
+	std::size_t size = 0;
+	bool mapped = false;		// mapped directly with mmap rather than through region
+	bool huge = false;
+
+	mmap_chunk(std::size_t size, void_mmap_allocator::PageMode pages);
+	mmap_chunk(std::string const &filename, std::size_t size);
+	~mmap_chunk();
 
-	mmap_file(std::string const &filename, std::size_t offset = 0);
-	~mmap_file();
+	void advise(void_mmap_allocator::Access access);
+	void discard();
 
-	void remove();
+	uint8_t *begin() { return data; }
+	uint8_t *end() { return data + size; }
 };
 
-using mmap_file_ptr = std::shared_ptr<mmap_file>;
+using mmap_chunk_ptr = std::unique_ptr<mmap_chunk>;
+
+namespace {
+	constexpr std::size_t MemoryChunkSize = 64 * 1024 * 1024;
+	constexpr std::size_t FileChunkSize = 1024000000;
+	constexpr std::size_t HugePageSize = 2 * 1024 * 1024;
+	constexpr std::size_t Alignment = 16;
+	constexpr std::size_t LargeSize = 4 * 1024 * 1024;		// bigger blocks get a mapping of their own
+	constexpr std::size_t MinSpareSize = 4096;				// smaller leftovers of a chunk aren't kept
+
+	// Freed blocks are listed by size class: multiples of 16 up to 128 bytes, then four
+	// steps per power of two up to LargeSize. A block is listed under the largest class
+	// it can hold, and a request served from the smallest class that holds it.
+	constexpr std::size_t SizeClassCount = 8 + 4 * 15;
+
+	std::array<std::size_t, SizeClassCount> const &sizeClasses() {
+		static const std::array<std::size_t, SizeClassCount> classes = []() {
+			std::array<std::size_t, SizeClassCount> c;
+			std::size_t i = 0;
+			for (std::size_t size = 16; size <= 128; size += 16) c[i++] = size;
+			for (std::size_t base = 128; base < LargeSize; base *= 2)
+				for (std::size_t k = 1; k <= 4; k++) c[i++] = base + k * base / 4;
+			return c;
+		}();
+		return classes;
+	}
 
-struct mmap_dir_t
-{
-	static constexpr std::size_t increase = 1024000000;  
-	static constexpr std::size_t alignment = 32;
+	std::size_t classHolding(std::size_t n) {
+		auto const &c = sizeClasses();
+		return std::lower_bound(c.begin(), c.end(), n) - c.begin();
+	}
 
-	std::string mmap_dir_filename;
-	bool mmap_dir_created = false;
+	std::size_t classHeldBy(std::size_t n) {
+		auto const &c = sizeClasses();
+		return std::upper_bound(c.begin(), c.end(), n) - c.begin() - 1;
+	}
 
-public:
-	~mmap_dir_t();
+	struct FreeBlock {
+		FreeBlock *next;
+	};
+	using free_lists_t = std::array<FreeBlock *, SizeClassCount>;
+
+	// What one thread has to hand out from an arena: the rest of a chunk, and freed blocks
+	struct ThreadArena {
+		unsigned int generation = 0;
+		uint8_t *next = nullptr;
+		uint8_t *end = nullptr;
+		free_lists_t free {};
+	};
+}
 
-	bool is_open();
-	void open_mmap_file(std::string const &filename, size_t file_size = increase);
-	void resize_mmap_file(size_t add_size);
-	
-	size_t mmap_file_size = 0;
+struct mmap_arena_t
+{
+	// Bumped when the arena is released, so threads know to drop what they hold
+	std::atomic<unsigned int> generation { 1 };
 
-	std::vector<mmap_file_ptr> files;
+	std::vector<mmap_chunk_ptr> chunks;
+	std::vector<std::pair<uint8_t *, uint8_t *>> spare;	// unused parts of chunks, for any thread
+	free_lists_t free {};									// handed back by threads that have finished
+	std::map<void const *, mmap_chunk_ptr> large;
 };
 
-thread_local mmap_file_ptr mmap_file_thread_ptr;
-
-struct mmap_shm 
+struct mmap_store_t
 {
 	std::mutex mutex;
-	std::vector<uint8_t> region;
-	boost::interprocess::managed_external_buffer buffer;
-
-	static size_t mmap_file_size;
-
-	mmap_shm(size_t size);
-
-	static void open(size_t add_size);
-	static void close();
+	std::string dir;
+	bool dirCreated = false;
+	std::size_t fileCount = 0;
+	std::size_t fileSize = 0;
+	std::size_t memorySize = 0;
+	std::size_t hugeSize = 0;
+
+	void_mmap_allocator::PageMode pages = void_mmap_allocator::PageMode::Normal;
+	bool accessHints = true;
+	void_mmap_allocator::Access access = void_mmap_allocator::Access::Sequential;
+
+	mmap_arena_t arenas[void_mmap_allocator::ArenaCount];
+
+	~mmap_store_t();
+
+	// All of these must be called with the mutex held
+	mmap_chunk_ptr map(std::size_t size);
+	void unmapped(mmap_chunk const &chunk);
+	void clear(mmap_arena_t &arena);
+	void refill(mmap_arena_t &arena, ThreadArena &thread, std::size_t n);
+	void handBack(mmap_arena_t &arena, ThreadArena &thread);
 };
 
-using mmap_shm_ptr = std::shared_ptr<mmap_shm>;
+static mmap_store_t mmap_store;
 
-using allocator_t = boost::interprocess::allocator<uint8_t, boost::interprocess::managed_external_buffer::segment_manager>;
-
-static mmap_dir_t mmap_dir;
-     
-std::vector< mmap_shm_ptr > mmap_shm_regions;  
-size_t mmap_shm::mmap_file_size = 0;
-thread_local mmap_shm_ptr mmap_shm_thread_region_ptr;
+// Threads hand their leftovers back when they finish, so the next ones can use them
+struct mmap_thread_state_t
+{
+	ThreadArena arenas[void_mmap_allocator::ArenaCount];
 
-std::mutex mmap_allocator_mutex;
+	~mmap_thread_state_t() {
+		std::lock_guard<std::mutex> lock(mmap_store.mutex);
+		for (unsigned int a = 0; a < void_mmap_allocator::ArenaCount; a++)
+			mmap_store.handBack(mmap_store.arenas[a], arenas[a]);
+	}
+};
 
-mmap_file::mmap_file(std::string const &filename, std::size_t offset)
-	: mapping(filename.c_str(), boost::interprocess::read_write)
-	, region(mapping, boost::interprocess::read_write)
-	, buffer(boost::interprocess::create_only, reinterpret_cast<uint8_t *>(region.get_address()) + offset, region.get_size() - offset)
-	, filename(filename)
-{ }
+thread_local mmap_thread_state_t mmap_thread_state;
 
-mmap_file::~mmap_file()
+mmap_chunk::mmap_chunk(std::size_t chunkSize, void_mmap_allocator::PageMode pages)
+	: size(chunkSize)
 {
-	mapping = boost::interprocess::file_mapping();
-	region = boost::interprocess::mapped_region();
-	buffer = boost::interprocess::managed_external_buffer();
+#ifdef TM_POSIX_MMAP
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_HUGETLB
+	if (pages == void_mmap_allocator::PageMode::HugeTLB) {
+		// Huge pages are reserved when mapped (so no MAP_NORESERVE), so this fails
+		// rather than faulting later if the pool is too small
+		std::size_t hugeSize = (size + HugePageSize - 1) & ~(HugePageSize - 1);
+		void *p = ::mmap(nullptr, hugeSize, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED) {
+			data = reinterpret_cast<uint8_t *>(p);
+			size = hugeSize;
+			mapped = huge = true;
+			return;
+		}
+		// The huge page pool is empty or not configured; use normal pages
+	}
+#endif
+#ifdef MAP_NORESERVE
+	flags |= MAP_NORESERVE;
+#endif
+	void *p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (p == MAP_FAILED) throw std::bad_alloc();
+	data = reinterpret_cast<uint8_t *>(p);
+	mapped = true;
+#ifdef MADV_HUGEPAGE
+	if (pages != void_mmap_allocator::PageMode::Normal)
+		huge = ::madvise(p, size, MADV_HUGEPAGE) == 0;
+#endif
+#else
+	region = boost::interprocess::anonymous_shared_memory(size);
+	data = reinterpret_cast<uint8_t *>(region.get_address());
+#endif
+}
 
-	remove();
+mmap_chunk::mmap_chunk(std::string const &filename, std::size_t size)
+	: filename(filename), size(size)
+{
+	if(std::ofstream(filename.c_str()).fail())
+		throw std::runtime_error("Failed to open mmap file");
+	boost::filesystem::resize_file(filename.c_str(), size);
+	mapping = boost::interprocess::file_mapping(filename.c_str(), boost::interprocess::read_write);
+	region = boost::interprocess::mapped_region(mapping, boost::interprocess::read_write);
+	data = reinterpret_cast<uint8_t *>(region.get_address());
 }
 
-void mmap_file::remove()
+mmap_chunk::~mmap_chunk()
 {
+#ifdef TM_POSIX_MMAP
+	if (mapped) ::munmap(data, size);
+#endif
+	if (!filename.empty() && mmap_store.accessHints) region.advise(boost::interprocess::mapped_region::advice_dontneed);
+	region = boost::interprocess::mapped_region();
+	mapping = boost::interprocess::file_mapping();
+
 	if(!filename.empty()) {
 		try {
 			boost::filesystem::remove(filename.c_str());
@@ -108,238 +216,694 @@ void mmap_file::remove()
 	}
 }
 
-void mmap_dir_t::open_mmap_file(std::string const &dir_filename, size_t file_size)
+void mmap_chunk::advise(void_mmap_allocator::Access access)
 {
-	mmap_dir_filename = dir_filename;
-	mmap_file_size = file_size;
-
-	mmap_dir_created |= boost::filesystem::create_directory(dir_filename);
+	if (filename.empty()) return;
+	region.advise(access == void_mmap_allocator::Access::Random ? 
+		boost::interprocess::mapped_region::advice_random : 
+		boost::interprocess::mapped_region::advice_sequential);
+}
 
-	std::string new_filename = mmap_dir_filename + "/mmap_" + to_string(mmap_dir.files.size()) + ".dat";
-	std::cout << "Filename: " << new_filename << ", size: " << mmap_file_size << std::endl;
-	if(std::ofstream(new_filename.c_str()).fail())
-		throw std::runtime_error("Failed to open mmap file");
-	boost::filesystem::resize_file(new_filename.c_str(), 0);
-	boost::filesystem::resize_file(new_filename.c_str(), mmap_file_size);
-	mmap_file_thread_ptr = std::make_shared<mmap_file>(new_filename.c_str());
+// Give the pages back to the OS, keeping the chunk mapped for reuse
+void mmap_chunk::discard()
+{
+#ifdef TM_POSIX_MMAP
+	if (mapped) { ::madvise(data, size, MADV_DONTNEED); return; }
+#endif
+	region.advise(boost::interprocess::mapped_region::advice_dontneed);
+}
 
-	mmap_dir.files.emplace_back(mmap_file_thread_ptr);
+mmap_store_t::~mmap_store_t()
+{
+	try {
+		for (auto &arena : arenas) {
+			arena.large.clear();
+			arena.chunks.clear();
+		}
+		if(dirCreated) boost::filesystem::remove(dir.c_str());
+	} catch(boost::filesystem::filesystem_error &e) {
+		std::cout << e.what() << std::endl;
+	}
 }
 
-void mmap_dir_t::resize_mmap_file(size_t add_size)
+mmap_chunk_ptr mmap_store_t::map(std::size_t size)
 {
-	auto offset = mmap_file_size;
-	auto size = increase + (add_size + alignment) - (add_size % alignment);
+	mmap_chunk_ptr chunk;
+	if(dir.empty()) {
+		chunk = std::make_unique<mmap_chunk>(size, pages);
+		memorySize += chunk->size;
+		if (chunk->huge) hugeSize += chunk->size;
+	} else {
+		std::string filename = dir + "/mmap_" + to_string(fileCount++) + ".dat";
+		chunk = std::make_unique<mmap_chunk>(filename, size);
+		if (accessHints) chunk->advise(access);
+		fileSize += chunk->size;
+	}
+	return chunk;
+}
 
-	std::string new_filename = mmap_dir_filename + "/mmap_" + to_string(mmap_dir.files.size()) + ".dat";
-	if(std::ofstream(new_filename.c_str()).fail())
-		throw std::runtime_error("Failed to open mmap file");
-	boost::filesystem::resize_file(new_filename.c_str(), size);
-	mmap_file_thread_ptr = std::make_shared<mmap_file>(new_filename.c_str(), 0);
+void mmap_store_t::unmapped(mmap_chunk const &chunk)
+{
+	if (chunk.filename.empty()) {
+		memorySize -= chunk.size;
+		if (chunk.huge) hugeSize -= chunk.size;
+	} else {
+		fileSize -= chunk.size;
+	}
+}
 
-	mmap_dir.files.emplace_back(mmap_file_thread_ptr);
-	mmap_file_size = offset + size;
+void mmap_store_t::clear(mmap_arena_t &arena)
+{
+	arena.generation++;
+	arena.spare.clear();
+	arena.free.fill(nullptr);
+	for (auto const &entry : arena.large) unmapped(*entry.second);
+	arena.large.clear();
 }
 
-bool mmap_dir_t::is_open() 
-{ 
-	return !mmap_dir.files.empty(); 
+void mmap_store_t::refill(mmap_arena_t &arena, ThreadArena &thread, std::size_t n)
+{
+	if (thread.end - thread.next >= static_cast<std::ptrdiff_t>(MinSpareSize))
+		arena.spare.emplace_back(thread.next, thread.end);
+
+	// Take on blocks freed by threads that have finished
+	for (std::size_t c = 0; c < SizeClassCount; c++) {
+		if (thread.free[c] || !arena.free[c]) continue;
+		thread.free[c] = arena.free[c];
+		arena.free[c] = nullptr;
+	}
+
+	for (auto it = arena.spare.begin(); it != arena.spare.end(); ++it) {
+		if (static_cast<std::size_t>(it->second - it->first) < n) continue;
+		thread.next = it->first;
+		thread.end = it->second;
+		*it = arena.spare.back();
+		arena.spare.pop_back();
+		return;
+	}
+
+	arena.chunks.emplace_back(map(dir.empty() ? MemoryChunkSize : FileChunkSize));
+	thread.next = arena.chunks.back()->begin();
+	thread.end = arena.chunks.back()->end();
 }
 
- mmap_dir_t::~mmap_dir_t()
+void mmap_store_t::handBack(mmap_arena_t &arena, ThreadArena &thread)
 {
-	if(!mmap_dir_filename.empty()) {
-		try {
-			files.clear();
+	if (thread.generation != arena.generation) return;
+	if (thread.end - thread.next >= static_cast<std::ptrdiff_t>(MinSpareSize))
+		arena.spare.emplace_back(thread.next, thread.end);
+	for (std::size_t c = 0; c < SizeClassCount; c++) {
+		if (!thread.free[c]) continue;
+		FreeBlock *tail = thread.free[c];
+		while (tail->next) tail = tail->next;
+		tail->next = arena.free[c];
+		arena.free[c] = thread.free[c];
+	}
+	thread = ThreadArena();
+}
 
-			if(mmap_dir_created) {
-				boost::filesystem::remove(mmap_dir_filename.c_str());
-			}
-		} catch(boost::filesystem::filesystem_error &e) {
-			std::cout << e.what() << std::endl;
-		}
+// This thread's part of an arena, dropping anything left from before it was released
+static inline ThreadArena &threadArena(void_mmap_allocator::Arena a)
+{
+	ThreadArena &thread = mmap_thread_state.arenas[a];
+	unsigned int generation = mmap_store.arenas[a].generation.load(std::memory_order_acquire);
+	if (thread.generation != generation) {
+		thread = ThreadArena();
+		thread.generation = generation;
 	}
+	return thread;
 }
 
-mmap_shm::mmap_shm(size_t size) 
-	: region(size)
-	, buffer(boost::interprocess::create_only, region.data(), region.size())
-{ }
+void * void_mmap_allocator::allocate(size_type n, Arena a)
+{
+	n = std::max<size_type>((n + Alignment - 1) & ~(Alignment - 1), Alignment);
+	mmap_arena_t &arena = mmap_store.arenas[a];
+
+	if (n > LargeSize) {
+		std::lock_guard<std::mutex> lock(mmap_store.mutex);
+		mmap_chunk_ptr chunk = mmap_store.map(n);
+		void *p = chunk->begin();
+		arena.large.emplace(p, std::move(chunk));
+		return p;
+	}
+
+	ThreadArena &thread = threadArena(a);
+	std::size_t c = classHolding(n);
+	if (FreeBlock *block = thread.free[c]) {
+		thread.free[c] = block->next;
+		return block;
+	}
+	if (static_cast<size_type>(thread.end - thread.next) < n) {
+		std::lock_guard<std::mutex> lock(mmap_store.mutex);
+		mmap_store.refill(arena, thread, n);
+	}
+	void *p = thread.next;
+	thread.next += n;
+	return p;
+}
 
-void mmap_shm::open(size_t add_size)
+void void_mmap_allocator::deallocate(void *p, size_type n, Arena a)
 {
-	constexpr std::size_t increase = 64000000;  
-	constexpr std::size_t alignment = 32;
+	if (p == nullptr) return;
+	n = std::max<size_type>((n + Alignment - 1) & ~(Alignment - 1), Alignment);
+
+	if (n > LargeSize) {
+		std::lock_guard<std::mutex> lock(mmap_store.mutex);
+		auto &large = mmap_store.arenas[a].large;
+		auto it = large.find(p);
+		if (it == large.end()) return;
+		mmap_store.unmapped(*it->second);
+		large.erase(it);
+		return;
+	}
 
-	auto size = increase + (add_size + alignment) - (add_size % alignment);
-	mmap_shm_thread_region_ptr = std::make_shared<mmap_shm>(size);
-	mmap_shm_regions.emplace_back(mmap_shm_thread_region_ptr);
-	mmap_file_size += size;
+	ThreadArena &thread = threadArena(a);
+	std::size_t c = classHeldBy(n);
+	FreeBlock *block = reinterpret_cast<FreeBlock *>(p);
+	block->next = thread.free[c];
+	thread.free[c] = block;
 }
 
-void mmap_shm::close() 
+void void_mmap_allocator::release(Arena a)
 {
-	mmap_shm_regions.clear();
-	mmap_shm_thread_region_ptr.reset();
+	std::lock_guard<std::mutex> lock(mmap_store.mutex);
+	mmap_arena_t &arena = mmap_store.arenas[a];
+	mmap_store.clear(arena);
+	for (auto &chunk : arena.chunks) {
+		chunk->discard();
+		arena.spare.emplace_back(chunk->begin(), chunk->end());
+	}
 }
 
-bool void_mmap_allocator_shutdown = false;
+void void_mmap_allocator::openStore(std::string const &dir)
+{
+	std::lock_guard<std::mutex> lock(mmap_store.mutex);
+	for (auto &arena : mmap_store.arenas) {
+		// Threads start on new chunks, so nothing more is carved from the anonymous ones
+		arena.generation++;
+		arena.spare.clear();
+		arena.free.fill(nullptr);
+	}
+	mmap_store.dir = dir;
+	mmap_store.dirCreated |= boost::filesystem::create_directory(dir);
+	std::cout << "Store files in " << dir << ", " << FileChunkSize << " bytes each" << std::endl;
+}
 
-void void_mmap_allocator::shutdown() { void_mmap_allocator_shutdown = true; }
+void void_mmap_allocator::usePages(PageMode mode)
+{
+	std::lock_guard<std::mutex> lock(mmap_store.mutex);
+	mmap_store.pages = mode;
+}
 
-void * void_mmap_allocator::allocate(size_type n, const void *hint)
+void void_mmap_allocator::useAccessHints(bool hints)
 {
-	while(true) {
-		try {
-			if(mmap_dir.is_open() && mmap_file_thread_ptr != nullptr) {	
-				auto &i = *mmap_file_thread_ptr;
-				std::lock_guard<std::mutex> lock(i.mutex);
-				allocator_t allocator(i.buffer.get_segment_manager());
-				return &(*allocator.allocate(n, hint));
-			} else if(mmap_shm_thread_region_ptr != nullptr) {	
-				auto &i = *mmap_shm_thread_region_ptr;
-				std::lock_guard<std::mutex> lock(i.mutex);
-				allocator_t allocator(i.buffer.get_segment_manager());
-				return &(*allocator.allocate(n, hint));
-			}
-		} catch(boost::interprocess::bad_alloc &e) {
-			// This mmap file is full
-		}
+	std::lock_guard<std::mutex> lock(mmap_store.mutex);
+	mmap_store.accessHints = hints;
+}
 
-		std::lock_guard<std::mutex> lock(mmap_allocator_mutex);
-		if(mmap_dir.is_open()) 
-			mmap_dir.resize_mmap_file(n);
-		else
-			mmap_shm::open(n);
+void void_mmap_allocator::advise(Access access)
+{
+	std::lock_guard<std::mutex> lock(mmap_store.mutex);
+	if (!mmap_store.accessHints || mmap_store.access == access) return;
+	mmap_store.access = access;
+	for (auto &arena : mmap_store.arenas) {
+		for (auto &chunk : arena.chunks) chunk->advise(access);
+		for (auto &entry : arena.large) entry.second->advise(access);
 	}
 }
 
-void void_mmap_allocator::deallocate(void *p, size_type n)
+std::size_t void_mmap_allocator::storeFileSize()
 {
-	destroy(p);
+	std::lock_guard<std::mutex> lock(mmap_store.mutex);
+	return mmap_store.fileSize;
 }
 
-void void_mmap_allocator::destroy(void *p)
+std::size_t void_mmap_allocator::memorySize()
 {
-	if(void_mmap_allocator_shutdown) return;
+	std::lock_guard<std::mutex> lock(mmap_store.mutex);
+	return mmap_store.memorySize;
+}
 
-	if(mmap_shm_thread_region_ptr != nullptr) {	
-		auto &i = *mmap_shm_thread_region_ptr;
-		if(p >= (void const *)i.region.data()  && p < reinterpret_cast<void const *>(reinterpret_cast<uint8_t const *>(i.region.data()) + i.region.size())) {
-			allocator_t allocator(i.buffer.get_segment_manager());
-			return allocator.destroy(reinterpret_cast<uint8_t *>(p));
-		}
+std::size_t void_mmap_allocator::hugePageSize()
+{
+	std::lock_guard<std::mutex> lock(mmap_store.mutex);
+	return mmap_store.hugeSize;
+}
+
+template<typename Buffer>
+static inline void writeVarint(Buffer &out, uint64_t value) {
+	while (value >= 0x80) {
+		out.push_back(static_cast<uint8_t>(value | 0x80));
+		value >>= 7;
 	}
+	out.push_back(static_cast<uint8_t>(value));
+}
 
-	if(mmap_file_thread_ptr != nullptr) {	
-		auto &i = *mmap_file_thread_ptr;
-		if(p >= i.region.get_address()  && p < reinterpret_cast<void const *>(reinterpret_cast<uint8_t const *>(i.region.get_address()) + i.region.get_size())) {
-			allocator_t allocator(i.buffer.get_segment_manager());
-			allocator.destroy(reinterpret_cast<uint8_t *>(p));
-			return;
-		}
-	} 
-
-	std::lock_guard<std::mutex> lock(mmap_allocator_mutex);
-	for(auto &i: mmap_shm_regions) {
-		if(p >= (void const *)i->region.data()  && p < reinterpret_cast<void const *>(reinterpret_cast<uint8_t const *>(i->region.data()) + i->region.size())) {
-			std::lock_guard<std::mutex> lock(i->mutex);
-			allocator_t allocator(i->buffer.get_segment_manager());
-			allocator.destroy(reinterpret_cast<uint8_t *>(p));
-			return;
-		}
+// ---- CompressedNodeStore
+
+void CompressedNodeStore::insert_back(std::vector<element_t> const &elements) {
+	if (elements.empty()) return;
+
+	// Chunks need ascending IDs; blocks are normally sorted already
+	std::vector<element_t> sorted;
+	std::vector<element_t> const *nodes = &elements;
+	if (!std::is_sorted(elements.begin(), elements.end(), [](auto const &a, auto const &b) { return a.first < b.first; })) {
+		sorted = elements;
+		std::stable_sort(sorted.begin(), sorted.end(), [](auto const &a, auto const &b) { return a.first < b.first; });
+		nodes = &sorted;
 	}
 
-	for(auto &i: mmap_dir.files) {
-		if(p >= i->region.get_address()  && p < reinterpret_cast<void const *>(reinterpret_cast<uint8_t const *>(i->region.get_address()) + i->region.get_size())) {
-			std::lock_guard<std::mutex> lock(i->mutex);
-			allocator_t allocator(i->buffer.get_segment_manager());
-			allocator.destroy(reinterpret_cast<uint8_t *>(p));
-			return;
-		}
-	} 
+	std::vector<Chunk> encoded;
+	for (auto it = nodes->begin(); it != nodes->end(); ) {
+		auto chunkEnd = it + std::min<size_t>(ChunkSize, nodes->end() - it);
+		// Keep repeated IDs in one chunk
+		while (chunkEnd != nodes->end() && chunkEnd->first == (chunkEnd - 1)->first) ++chunkEnd;
+		encoded.push_back(encodeChunk(it, chunkEnd));
+		it = chunkEnd;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	for (Chunk const &chunk : encoded) {
+		chunks.push_back(chunk);
+		count += chunk.nodes;
+		bytes += chunk.length;
+	}
+	generation++;
+}
+
+CompressedNodeStore::Chunk CompressedNodeStore::encodeChunk(std::vector<element_t>::const_iterator begin, std::vector<element_t>::const_iterator end) {
+	static thread_local std::vector<uint8_t> buffer;
+	buffer.clear();
+
+	NodeID prevId = begin->first;
+	int64_t prevLatp = 0, prevLon = 0;
+	uint32_t nodes = 0;
+	for (auto it = begin; it != end; ++it) {
+		// Keep the last of any repeated IDs
+		if (it + 1 != end && (it + 1)->first == it->first) continue;
+		writeVarint(buffer, it->first - prevId);
+		writeVarint(buffer, zigzag(it->second.latp - prevLatp));
+		writeVarint(buffer, zigzag(it->second.lon - prevLon));
+		prevId = it->first;
+		prevLatp = it->second.latp;
+		prevLon = it->second.lon;
+		nodes++;
+	}
+
+	uint8_t *data = reinterpret_cast<uint8_t *>(void_mmap_allocator::allocate(buffer.size()));
+	std::copy(buffer.begin(), buffer.end(), data);
+	return { begin->first, (end - 1)->first, data, static_cast<uint32_t>(buffer.size()), nodes };
+}
+
+void CompressedNodeStore::decodeChunk(Chunk const &chunk, NodeID *ids, LatpLon *coords) {
+	uint8_t const *ptr = chunk.data;
+	NodeID id = chunk.first;
+	int64_t latp = 0, lon = 0;
+	for (uint32_t n = 0; n < chunk.nodes; n++) {
+		id   += readVarint(ptr);
+		latp += unzigzag(readVarint(ptr));
+		lon  += unzigzag(readVarint(ptr));
+		ids[n] = id;
+		coords[n] = { static_cast<int32_t>(latp), static_cast<int32_t>(lon) };
+	}
 }
 
-void NodeStore::sort(unsigned int threadNum) { 
+void CompressedNodeStore::sort(unsigned int threadNum) {
 	std::lock_guard<std::mutex> lock(mutex);
 	boost::sort::block_indirect_sort(
-		mLatpLons->begin(), mLatpLons->end(), 
+		chunks.begin(), chunks.end(), 
 		[](auto const &a, auto const &b) { return a.first < b.first; }, 
 		threadNum);
+
+	// Blocks from different input files can cover overlapping ID ranges. Re-encode
+	// each run of overlapping chunks so that any ID can only be in one chunk.
+	std::vector<Chunk> merged;
+	merged.reserve(chunks.size());
+	std::vector<element_t> nodes;
+	NodeID ids[ChunkSize];
+	LatpLon coords[ChunkSize];
+	for (size_t k = 0; k < chunks.size(); ) {
+		size_t runEnd = k + 1;
+		NodeID last = chunks[k].last;
+		while (runEnd < chunks.size() && chunks[runEnd].first <= last) {
+			last = std::max(last, chunks[runEnd].last);
+			runEnd++;
+		}
+		if (runEnd == k + 1) { merged.push_back(chunks[k++]); continue; }
+
+		nodes.clear();
+		for (; k < runEnd; k++) {
+			decodeChunk(chunks[k], ids, coords);
+			for (uint32_t n = 0; n < chunks[k].nodes; n++) nodes.emplace_back(ids[n], coords[n]);
+			void_mmap_allocator::deallocate(const_cast<uint8_t *>(chunks[k].data), chunks[k].length);
+			count -= chunks[k].nodes;
+			bytes -= chunks[k].length;
+		}
+		std::stable_sort(nodes.begin(), nodes.end(), [](auto const &a, auto const &b) { return a.first < b.first; });
+		for (auto it = nodes.begin(); it != nodes.end(); ) {
+			auto chunkEnd = it + std::min<size_t>(ChunkSize, nodes.end() - it);
+			while (chunkEnd != nodes.end() && chunkEnd->first == (chunkEnd - 1)->first) ++chunkEnd;
+			merged.push_back(encodeChunk(it, chunkEnd));
+			count += merged.back().nodes;
+			bytes += merged.back().length;
+			it = chunkEnd;
+		}
+	}
+	chunks.swap(merged);
+	generation++;
 }
 
-void WayStore::sort(unsigned int threadNum) { 
+void CompressedNodeStore::clear() {
 	std::lock_guard<std::mutex> lock(mutex);
-	boost::sort::block_indirect_sort(
-		mLatpLonLists->begin(), mLatpLonLists->end(), 
-		[](auto const &a, auto const &b) { return a.first < b.first; }, 
-		threadNum);
+	for (Chunk const &chunk : chunks)
+		void_mmap_allocator::deallocate(const_cast<uint8_t *>(chunk.data), chunk.length);
+	chunks.clear();
+	count = 0;
+	bytes = 0;
+	generation++;
+}
+
+namespace {
+	// A chunk decoded by this thread
+	struct DecodedChunk {
+		CompressedNodeStore const *store = nullptr;
+		uint64_t generation = 0;
+		uint8_t const *data = nullptr;
+		uint32_t nodes = 0;
+		NodeID ids[CompressedNodeStore::ChunkSize];
+		LatpLon coords[CompressedNodeStore::ChunkSize];
+	};
+	constexpr unsigned int DecodedChunkCacheSize = 8;
+	thread_local std::unique_ptr<DecodedChunk[]> decodedChunks;
+}
+
+LatpLon CompressedNodeStore::at(NodeID i) const {
+	// Last chunk starting at or before i
+	auto chunk = std::upper_bound(chunks.begin(), chunks.end(), i, [](NodeID i, Chunk const &c) { return i < c.first; });
+	if (chunk == chunks.begin() || (--chunk)->last < i)
+		throw std::out_of_range("Could not find node with id " + std::to_string(i));
+
+	if (!decodedChunks) decodedChunks.reset(new DecodedChunk[DecodedChunkCacheSize]);
+	uint64_t currentGeneration = generation.load(std::memory_order_relaxed);
+	DecodedChunk &decoded = decodedChunks[(chunk - chunks.begin()) % DecodedChunkCacheSize];
+	if (decoded.store != this || decoded.generation != currentGeneration || decoded.data != chunk->data) {
+		decodeChunk(*chunk, decoded.ids, decoded.coords);
+		decoded.store = this;
+		decoded.generation = currentGeneration;
+		decoded.data = chunk->data;
+		decoded.nodes = chunk->nodes;
+	}
+
+	auto found = std::lower_bound(decoded.ids, decoded.ids + decoded.nodes, i);
+	if (found == decoded.ids + decoded.nodes || *found != i)
+		throw std::out_of_range("Could not find node with id " + std::to_string(i));
+	return decoded.coords[found - decoded.ids];
+}
+
+// ---- SparseNodeStore
+
+void SparseNodeStore::reopen() {
+	clear();
+	std::lock_guard<std::mutex> lock(mutex);
+	directory.resize(NodeID(1) << (MaxIdBits - PageBits - ChunkBits));
+	bytes = directory.size() * sizeof(directory[0]);
+}
+
+void SparseNodeStore::clear() {
+	std::lock_guard<std::mutex> lock(mutex);
+	for (auto &chunk : directory) {
+		if (!chunk) continue;
+		for (Page *page : *chunk) {
+			if (page) void_mmap_allocator::deallocate(page, Page::bytes(page->size()));
+		}
+		chunk.reset();
+	}
+	count = 0;
+	bytes = directory.size() * sizeof(directory[0]);
+}
+
+void SparseNodeStore::insert_back(std::vector<element_t> const &elements) {
+	if (elements.empty()) return;
+
+	// Blocks are normally in ID order already; sort a copy if not, so each page is merged once
+	std::vector<element_t> sorted;
+	std::vector<element_t> const *nodes = &elements;
+	if (!std::is_sorted(elements.begin(), elements.end(), [](auto const &a, auto const &b) { return a.first < b.first; })) {
+		sorted = elements;
+		std::stable_sort(sorted.begin(), sorted.end(), [](auto const &a, auto const &b) { return a.first < b.first; });
+		nodes = &sorted;
+	}
+	if (nodes->back().first >> MaxIdBits)
+		throw std::out_of_range("Node id " + std::to_string(nodes->back().first) + " is too large for the sparse node store");
+
+	std::lock_guard<std::mutex> lock(mutex);
+	for (auto it = nodes->begin(); it != nodes->end(); ) {
+		NodeID pageIndex = it->first >> PageBits;
+		auto pageEnd = it;
+		while (pageEnd != nodes->end() && (pageEnd->first >> PageBits) == pageIndex) ++pageEnd;
+
+		auto &chunk = directory[pageIndex >> ChunkBits];
+		if (!chunk) {
+			chunk = std::make_unique<chunk_t>();
+			chunk->fill(nullptr);
+			bytes += sizeof(chunk_t);
+		}
+		mergePage((*chunk)[pageIndex & (ChunkSize - 1)], it, pageEnd);
+		it = pageEnd;
+	}
+}
+
+// Combine a page's existing nodes with new ones (in ID order, all on this page)
+// into a newly allocated page
+void SparseNodeStore::mergePage(Page *&page, std::vector<element_t>::const_iterator begin, std::vector<element_t>::const_iterator end) {
+	Page merged = {};
+	if (page) merged = *page;
+	for (auto it = begin; it != end; ++it) {
+		unsigned int bit = it->first & (PageSize - 1);
+		merged.present[bit / 64] |= uint64_t(1) << (bit % 64);
+	}
+
+	unsigned int oldSize = page ? page->size() : 0;
+	unsigned int newSize = merged.size();
+	Page *target = reinterpret_cast<Page *>(void_mmap_allocator::allocate(Page::bytes(newSize)));
+	*target = merged;
+
+	LatpLon *out = target->coords();
+	if (!page) {
+		// New page: copy across, keeping the last of any repeated IDs
+		for (auto it = begin; it != end; ++it) {
+			if (it + 1 != end && (it + 1)->first == it->first) continue;
+			*out++ = it->second;
+		}
+		count += newSize;
+		bytes += Page::bytes(newSize);
+		page = target;
+		return;
+	}
+
+	// Walk the page's IDs in order, taking new nodes in preference to existing ones
+	LatpLon const *old = page->coords();
+	auto it = begin;
+	for (unsigned int bit = 0; bit < PageSize; bit++) {
+		bool inOld = (page->present[bit / 64] & (uint64_t(1) << (bit % 64)));
+		bool inNew = false;
+		while (it != end && (it->first & (PageSize - 1)) == bit) { *out = it->second; inNew = true; ++it; }
+		if (inNew) { out++; if (inOld) old++; }
+		else if (inOld) { *out++ = *old++; }
+	}
+
+	void_mmap_allocator::deallocate(page, Page::bytes(oldSize));
+	count += newSize - oldSize;
+	bytes += Page::bytes(newSize) - Page::bytes(oldSize);
+	page = target;
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+#define PREFETCH(address) __builtin_prefetch(address)
+#else
+#define PREFETCH(address)
+#endif
+
+void NodeStore::at(std::vector<NodeID> const &ids, std::vector<LatpLon> &out, std::vector<bool> &found) const {
+	out.resize(ids.size());
+	found.assign(ids.size(), false);
+
+	auto const &segments = store.allSegments();
+	auto const &firstIds = store.segmentFirstIds();
+	if (firstIds.empty()) return;
+
+	// Gallop forward from the previous match, so a block's refs (which are mostly
+	// close together) cost a few probes each rather than a search of the whole store
+	std::size_t s = 0;
+	auto pos = segments[0].begin();
+	for (size_t n = 0; n < ids.size(); n++) {
+		NodeID id = ids[n];
+
+		// Move on to the segment that would hold this ID
+		if (s + 1 < firstIds.size() && firstIds[s + 1] <= id) {
+			s = std::upper_bound(firstIds.begin() + s + 1, firstIds.end(), id) - firstIds.begin() - 1;
+			pos = segments[s].begin();
+		}
+		auto end = segments[s].end();
+
+		size_t step = 1;
+		auto lo = pos;
+		while (static_cast<size_t>(end - lo) > step && (lo + step)->first < id) {
+			lo += step;
+			step *= 2;
+			if (static_cast<size_t>(end - lo) > step * 2) PREFETCH(&*(lo + step * 2));
+		}
+		auto hi = static_cast<size_t>(end - lo) > step ? lo + step + 1 : end;
+		pos = std::lower_bound(lo, hi, id, [](auto const &e, auto i) { return e.first < i; });
+		if (pos != end && pos->first == id) {
+			out[n] = pos->second;
+			found[n] = true;
+		}
+	}
+}
+
+// ---- RelationScanStore
+
+void RelationScanStore::sort(unsigned int threadNum) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	// Anything compacted from an earlier file is merged with what's been scanned since
+	for (std::size_t i = 0; i < wayIds.size(); i++)
+		for (std::size_t j = wayOffsets[i]; j < wayOffsets[i+1]; j++)
+			pendingWays.emplace_back(wayIds[i], relationIds[j]);
+	for (std::size_t i = 0; i < tagRelationIds.size(); i++)
+		for (std::size_t j = tagOffsets[i]; j < tagOffsets[i+1]; j++)
+			pendingTags.push_back({ tagRelationIds[i], tags[j].first, tags[j].second });
+
+	boost::sort::block_indirect_sort(pendingWays.begin(), pendingWays.end(), threadNum);
+	pendingWays.erase(std::unique(pendingWays.begin(), pendingWays.end()), pendingWays.end());
+	wayIds.clear();
+	wayOffsets.clear();
+	relationIds.clear();
+	relationIds.reserve(pendingWays.size());
+	for (auto const &entry : pendingWays) {
+		if (wayIds.empty() || wayIds.back() != entry.first) {
+			wayIds.push_back(entry.first);
+			wayOffsets.push_back(relationIds.size());
+		}
+		relationIds.push_back(entry.second);
+	}
+	wayOffsets.push_back(relationIds.size());
+	std::vector<std::pair<WayID, WayID>>().swap(pendingWays);
+
+	// A relation read twice keeps its first value for each key
+	std::stable_sort(pendingTags.begin(), pendingTags.end(), [](PendingTag const &a, PendingTag const &b) {
+		return a.relid < b.relid || (a.relid == b.relid && a.key < b.key);
+	});
+	tagRelationIds.clear();
+	tagOffsets.clear();
+	tags.clear();
+	tags.reserve(pendingTags.size());
+	for (PendingTag const &tag : pendingTags) {
+		if (tagRelationIds.empty() || tagRelationIds.back() != tag.relid) {
+			tagRelationIds.push_back(tag.relid);
+			tagOffsets.push_back(tags.size());
+		} else if (tags.back().first == tag.key) continue;
+		tags.emplace_back(tag.key, tag.value);
+	}
+	tagOffsets.push_back(tags.size());
+	std::vector<PendingTag>().swap(pendingTags);
 }
 
-static inline bool isClosed(WayStore::latplon_vector_t const &way) {
+std::string const &RelationScanStore::get_relation_tag(WayID relid, std::string const &key) const {
+	static const std::string empty;
+	auto rel = std::lower_bound(tagRelationIds.begin(), tagRelationIds.end(), relid);
+	if (rel == tagRelationIds.end() || *rel != relid) return empty;
+	auto keyId = stringIds.find(key);
+	if (keyId == stringIds.end()) return empty;
+
+	std::size_t i = rel - tagRelationIds.begin();
+	auto first = tags.begin() + tagOffsets[i], last = tags.begin() + tagOffsets[i+1];
+	auto tag = std::lower_bound(first, last, keyId->second, [](std::pair<uint32_t, uint32_t> const &t, uint32_t k) { return t.first < k; });
+	if (tag == last || tag->first != keyId->second) return empty;
+	return strings[tag->second];
+}
+
+// ---- WayStore
+
+void WayStore::insert_back(std::size_t segment, std::vector<input_t> const &new_ways) {
+	if (store.isFrozen()) throw std::logic_error("Can't insert ways once the way store has been sorted");
+
+	// Each arena is only written by the thread reading its block
+	arena_t &arena = arenas.at(segment);
+	std::vector<element_t> index;
+	index.reserve(new_ways.size());
+	std::vector<uint8_t> encoded;
+	for (auto const &way : new_ways) {
+		encoded.clear();
+		int64_t prevLatp = 0, prevLon = 0;
+		for (LatpLon const &ll : way.second) {
+			writeVarint(encoded, zigzag(ll.latp - prevLatp));
+			writeVarint(encoded, zigzag(ll.lon - prevLon));
+			prevLatp = ll.latp;
+			prevLon = ll.lon;
+		}
+		if (arena.size() + encoded.size() + 10 > std::numeric_limits<uint32_t>::max())
+			throw std::runtime_error("Way store arena for one block is too large");
+
+		index.emplace_back(way.first, Location{ static_cast<uint32_t>(segment), static_cast<uint32_t>(arena.size()) });
+		writeVarint(arena, encoded.size());
+		arena.insert(arena.end(), encoded.begin(), encoded.end());
+	}
+	store.append(segment, index);
+}
+
+void WayStore::sort(unsigned int threadNum, bool sortedFile) {
+	store.sort(threadNum, sortedFile);
+	for (auto &arena : arenas) arena.shrink_to_fit();
+}
+
+static inline bool isClosed(WayStore::way_t const &way) {
 	return way.begin() == way.end();
 }
 
 void OSMStore::open(std::string const &osm_store_filename)
 {
-	mmap_dir.open_mmap_file(osm_store_filename);
+	void_mmap_allocator::openStore(osm_store_filename);
+	// Start the stores again so they're allocated in the files
 	reopen();
-	mmap_shm::close();
 }
 
-void OSMStore::shapes_sort(unsigned int threadNum)
+void OSMStore::nodes_sort(unsigned int threadNum, bool sortedFile) 
 {
-	std::cout << "Sorting loaded shapes" << std::endl;
-	boost::sort::block_indirect_sort(
-		shp_generated.points_store->begin(), shp_generated.points_store->end(), 
-		[](auto const &a, auto const &b) { return a.first < b.first; }, threadNum);
-	boost::sort::block_indirect_sort(
-		shp_generated.linestring_store->begin(), shp_generated.linestring_store->end(), 
-		[](auto const &a, auto const &b) { return a.first < b.first; }, 
-		threadNum);
-	boost::sort::block_indirect_sort(
-		shp_generated.multi_polygon_store->begin(), shp_generated.multi_polygon_store->end(), 
-		[](auto const &a, auto const &b) { return a.first < b.first; }, 
-		threadNum);
+	// From here on, nodes are looked up rather than inserted
+	void_mmap_allocator::advise(void_mmap_allocator::Access::Random);
+	if(node_store_type == NodeStoreType::Compressed) {
+		compressed_nodes.sort(threadNum);
+		return;
+	}
+	if(node_store_type != NodeStoreType::Sorted) return;
+	if(!sortedFile) std::cout << "\nSorting nodes" << std::endl;
+	nodes.sort(threadNum, sortedFile);
 }
 
-void OSMStore::generated_sort(unsigned int threadNum)
-{
-	std::cout << "Sorting generated geometries" << std::endl;
-	std::lock_guard<std::mutex> lock_points(osm_generated.points_store_mutex);
-	boost::sort::block_indirect_sort(
-		osm_generated.points_store->begin(), osm_generated.points_store->end(), 
-		[](auto const &a, auto const &b) { return a.first < b.first; }, threadNum);
-
-	std::lock_guard<std::mutex> lock_linestring(osm_generated.linestring_store_mutex);
-	boost::sort::block_indirect_sort(
-		osm_generated.linestring_store->begin(), osm_generated.linestring_store->end(), 
-		[](auto const &a, auto const &b) { return a.first < b.first; }, 
-		threadNum);
-
-	std::lock_guard<std::mutex> lock_multi_linestring(osm_generated.multi_linestring_store_mutex);
-	boost::sort::block_indirect_sort(
-		osm_generated.multi_linestring_store->begin(), osm_generated.multi_linestring_store->end(), 
-		[](auto const &a, auto const &b) { return a.first < b.first; }, 
-		threadNum);
-	
-	std::lock_guard<std::mutex> lock_multi_polygon(osm_generated.multi_polygon_store_mutex);
-	boost::sort::block_indirect_sort(
-		osm_generated.multi_polygon_store->begin(), osm_generated.multi_polygon_store->end(), 
-		[](auto const &a, auto const &b) { return a.first < b.first; }, 
-		threadNum);
-}
+void OSMStore::nodes_at(std::vector<NodeID> const &ids, std::vector<LatpLon> &out, std::vector<bool> &found) const {
+	if (node_store_type == NodeStoreType::Sorted) {
+		nodes.at(ids, out, found);
+		return;
+	}
 
-void OSMStore::nodes_sort(unsigned int threadNum) 
-{
-	std::cout << "\nSorting nodes" << std::endl;
-	if(!use_compact_nodes)
-		nodes.sort(threadNum);
+	// The other stores look up each node directly; ascending order still helps
+	// the compressed store reuse its decoded chunks
+	out.resize(ids.size());
+	found.assign(ids.size(), false);
+	for (size_t n = 0; n < ids.size(); n++) {
+		try {
+			out[n] = nodes_at(ids[n]);
+			found[n] = true;
+		} catch (std::out_of_range &) { }
+	}
 }
 
-void OSMStore::ways_sort(unsigned int threadNum) { 
-	std::cout << "\nSorting ways" << std::endl;
-	ways.sort(threadNum); 
+void OSMStore::ways_sort(unsigned int threadNum, bool sortedFile) { 
+	void_mmap_allocator::advise(void_mmap_allocator::Access::Random);
+	if(!sortedFile) std::cout << "\nSorting ways" << std::endl;
+	ways.sort(threadNum, sortedFile); 
 }
 
 MultiPolygon OSMStore::wayListMultiPolygon(WayVec::const_iterator outerBegin, WayVec::const_iterator outerEnd, WayVec::const_iterator innerBegin, WayVec::const_iterator innerEnd) const {
@@ -399,7 +963,7 @@ MultiLinestring OSMStore::wayListMultiLinestring(WayVec::const_iterator outerBeg
 // - Linestrings are joined to existing linestrings with which they share a start/end
 // - If no matches can be found, then one linestring is added (to 'attract' others)
 // - The process is rerun until no ways are left
-// There's quite a lot of copying going on here - could potentially be addressed
+// Ways are decoded straight from the way store as they're added to the results
 void OSMStore::mergeMultiPolygonWays(std::vector<LatpLonDeque> &results, std::map<WayID,bool> &done, WayVec::const_iterator itBegin, WayVec::const_iterator itEnd) const {
 
 	// Create maps of start/end nodes
@@ -408,7 +972,7 @@ void OSMStore::mergeMultiPolygonWays(std::vector<LatpLonDeque> &results, std::ma
 	for (auto it = itBegin; it != itEnd; ++it) {
 		if (done[*it]) { continue; }
 		try {
-			auto const &way = ways.at(*it);
+			auto way = ways.at(*it);
 			if (isClosed(way) || results.empty()) {
 				// if start==end, simply add it to the set
 				results.emplace_back(way.begin(), way.end());
@@ -430,7 +994,7 @@ void OSMStore::mergeMultiPolygonWays(std::vector<LatpLonDeque> &results, std::ma
 		if (waylist.empty()) { nodemap.erase(nodemap.find(n)); }
 	};
 	auto removeWay = [&](WayID w) {
-		auto const &way = ways.at(w);
+		auto way = ways.at(w);
 		LatpLon first = way.front();
 		LatpLon last  = way.back();
 		if (startNodes.find(first) != startNodes.end()) { deleteFromWayList(first, w, true ); }
@@ -462,9 +1026,9 @@ void OSMStore::mergeMultiPolygonWays(std::vector<LatpLonDeque> &results, std::ma
 					// append reversed to the original
 					auto match = endNodes.find(rLast)->second;
 					auto nodes = ways.at(match.back());
-					rt->insert(rt->end(),
-						std::make_reverse_iterator(nodes.end()),
-						std::make_reverse_iterator(nodes.begin()));
+					auto oldSize = rt->size();
+					rt->insert(rt->end(), nodes.begin(), nodes.end());
+					std::reverse(rt->begin() + oldSize, rt->end());
 					removeWay(match.back());
 					added++;
 
@@ -480,9 +1044,7 @@ void OSMStore::mergeMultiPolygonWays(std::vector<LatpLonDeque> &results, std::ma
 					// prepend reversed to the original
 					auto match = startNodes.find(rFirst)->second;
 					auto nodes = ways.at(match.back());
-					rt->insert(rt->begin(),
-						std::make_reverse_iterator(nodes.end()),
-						std::make_reverse_iterator(nodes.begin()));
+					for (LatpLon ll : nodes) rt->push_front(ll);
 					removeWay(match.back());
 					added++;
 
@@ -496,7 +1058,7 @@ void OSMStore::mergeMultiPolygonWays(std::vector<LatpLonDeque> &results, std::ma
 			if (added>0) continue;
 			for (auto nt : (i==0 ? startNodes : endNodes)) {
 				WayID w = nt.second.back();
-				auto const &way = ways.at(w);
+				auto way = ways.at(w);
 				results.emplace_back(way.begin(), way.end());
 				added++;
 				removeWay(w);
@@ -508,11 +1070,14 @@ void OSMStore::mergeMultiPolygonWays(std::vector<LatpLonDeque> &results, std::ma
 
 
 void OSMStore::reportStoreSize(std::ostringstream &str) {
-	if (mmap_dir.mmap_file_size>0) { str << "Store size " << (mmap_dir.mmap_file_size / 1000000000) << "G | "; }
+	std::size_t storeSize = void_mmap_allocator::storeFileSize();
+	if (storeSize>0) { str << "Store size " << (storeSize / 1000000000) << "G | "; }
+	std::size_t hugeSize = void_mmap_allocator::hugePageSize();
+	if (hugeSize>0) { str << "Huge pages " << (hugeSize / 1000000) << "/" << (void_mmap_allocator::memorySize() / 1000000) << "M | "; }
 }
 
 void OSMStore::reportSize() const {
-	std::cout << "Stored " << nodes.size() << " nodes, " << ways.size() << " ways, " << relations.size() << " relations" << std::endl;
+	std::cout << "Stored " << nodes_size() << " nodes, " << ways.size() << " ways, " << relations.size() << " relations" << std::endl;
 	std::cout << "Shape points: " << shp_generated.points_store->size() << ", lines: " << shp_generated.linestring_store->size() << ", polygons: " << shp_generated.multi_polygon_store->size() << std::endl;
 	std::cout << "Generated points: " << osm_generated.points_store->size() << ", lines: " << osm_generated.linestring_store->size() << ", polygons: " << osm_generated.multi_polygon_store->size() << std::endl;
 }
@@ -74,7 +74,7 @@ Geometry buildWayGeometry(OSMStore &osmStore, OutputObject const &oo, const Tile
 	switch(oo.geomType) {
 		case POINT_:
 		{
-			auto p = osmStore.retrieve_point((oo.objectID >> OSMID_TYPE_OFFSET) > 0 ? osmStore.osm() : osmStore.shp(), oo.objectID);
+			auto p = OSMStore::retrieve_point(oo.handle);
 			if (geom::within(p, bbox.clippingBox)) {
 				return p;
 			} 
@@ -83,7 +83,7 @@ Geometry buildWayGeometry(OSMStore &osmStore, OutputObject const &oo, const Tile
 
 		case LINESTRING_:
 		{
-			auto const &ls = osmStore.retrieve_linestring((oo.objectID >> OSMID_TYPE_OFFSET) > 0 ? osmStore.osm() : osmStore.shp(), oo.objectID);
+			auto const &ls = OSMStore::retrieve_linestring(oo.handle);
 
 			MultiLinestring out;
 			if(ls.empty())
@@ -111,7 +111,7 @@ Geometry buildWayGeometry(OSMStore &osmStore, OutputObject const &oo, const Tile
 
 		case MULTILINESTRING_:
 		{
-			auto const &mls = osmStore.retrieve_multi_linestring((oo.objectID >> OSMID_TYPE_OFFSET) > 0 ? osmStore.osm() : osmStore.shp(), oo.objectID);
+			auto const &mls = OSMStore::retrieve_multi_linestring(oo.handle);
 			// investigate whether filtering the constituent linestrings improves performance
 			MultiLinestring result;
 			geom::intersection(mls, bbox.getExtendBox(), result);
@@ -120,7 +120,7 @@ Geometry buildWayGeometry(OSMStore &osmStore, OutputObject const &oo, const Tile
 
 		case POLYGON_:
 		{
-			auto const &input = osmStore.retrieve_multi_polygon((oo.objectID >> OSMID_TYPE_OFFSET) > 0 ? osmStore.osm() : osmStore.shp(), oo.objectID);
+			MultiPolygon input = OSMStore::retrieve_multi_polygon(oo.handle);
 
 			Box box = bbox.clippingBox;
 			
@@ -167,8 +167,7 @@ Geometry buildWayGeometry(OSMStore &osmStore, OutputObject const &oo, const Tile
 					std::min(box.max_corner().y(), extBox.max_corner().y()));
 			}
 
-			MultiPolygon mp;
-			geom::assign(mp, input);
+			MultiPolygon mp = std::move(input);
 			fast_clip(mp, box);
 			geom::correct(mp);
 			return mp;
@@ -184,7 +183,7 @@ LatpLon buildNodeGeometry(OSMStore &osmStore, OutputObject const &oo, const Tile
 	switch(oo.geomType) {
 		case POINT_:
 		{
-			auto p = osmStore.retrieve_point((oo.objectID >> OSMID_TYPE_OFFSET) > 0 ? osmStore.osm() : osmStore.shp(), oo.objectID);
+			auto p = OSMStore::retrieve_point(oo.handle);
 			LatpLon out;
 			out.latp = p.y();
 			out.lon = p.x();
@@ -1,6 +1,8 @@
 #include "pbf_blocks.h"
 #include "helpers.h"
+#include "pbf_decoder.h"
 #include <fstream>
+#include <cstring>
 using namespace std;
 
 /* -------------------
@@ -32,12 +34,30 @@ BlobHeader readHeader(istream &input) {
 void readBlock(google::protobuf::Message *messagePtr, std::size_t datasize, istream &input) {
 	if (input.eof()) { return ; }
 
-	// get Blob and parse
-	Blob blob;
-	readMessage(&blob, input, datasize);
+	// get Blob, decompress and parse
+	vector<char> buffer(datasize);
+	input.read(buffer.data(), datasize);
+	readBlock(messagePtr, buffer.data(), datasize);
+}
+
+bool readHeader(BlobHeader &bh, char const *data, std::size_t size, std::size_t &offset) {
+	if (offset + sizeof(unsigned int) > size) { return false; }
+
+	unsigned int headerSize;
+	memcpy(&headerSize, data + offset, sizeof(headerSize));
+	endian_swap(headerSize);
+	if (offset + sizeof(headerSize) + headerSize > size) { return false; }
+
+	// get BlobHeader and parse
+	if (!bh.ParseFromArray(data + offset + sizeof(headerSize), headerSize)) { return false; }
+	offset += sizeof(headerSize) + headerSize;
+	return offset + bh.datasize() <= size;
+}
 
-	// Unzip the gzipped content
-	string contents = decompress_string(blob.zlib_data(), false);
+void readBlock(google::protobuf::Message *messagePtr, char const *data, std::size_t datasize) {
+	// get Blob and decompress (whichever codec it uses), then parse
+	string contents;
+	pbfReadBlob(data, datasize, contents);
 	messagePtr->ParseFromString(contents);
 }
 
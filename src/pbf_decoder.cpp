@@ -0,0 +1,183 @@
+#include "pbf_decoder.h"
+#include "helpers.h"
+#include <memory>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+using namespace std;
+
+// The .pbf format caps an uncompressed blob at 32MiB; raw_size is checked against
+// this before any buffer is sized from it, so a corrupt blob can't ask for gigabytes
+static const size_t maxBlobSize = 32 * 1024 * 1024;
+
+PbfDenseNodes::PbfDenseNodes(PbfSlice message) {
+	PbfFieldReader reader(message);
+	while (reader.next()) {
+		switch (reader.field()) {
+			case 1:  ids.read(reader); break;
+			case 8:  lats.read(reader); break;
+			case 9:  lons.read(reader); break;
+			case 10: keysVals.read(reader); break;
+			default: reader.skip();
+		}
+	}
+}
+
+PbfWay::PbfWay(PbfSlice message) {
+	PbfFieldReader reader(message);
+	while (reader.next()) {
+		switch (reader.field()) {
+			case 1:  id   = static_cast<int64_t>(reader.varint()); break;
+			case 2:  keys.read(reader); break;
+			case 3:  vals.read(reader); break;
+			case 8:  refs.read(reader); break;
+			case 9:  lats.read(reader); break;
+			case 10: lons.read(reader); break;
+			default: reader.skip();
+		}
+	}
+}
+
+PbfRelation::PbfRelation(PbfSlice message) {
+	PbfFieldReader reader(message);
+	while (reader.next()) {
+		switch (reader.field()) {
+			case 1:  id       = static_cast<int64_t>(reader.varint()); break;
+			case 2:  keys.read(reader); break;
+			case 3:  vals.read(reader); break;
+			case 8:  rolesSid.read(reader); break;
+			case 9:  memids.read(reader); break;
+			case 10: types.read(reader); break;
+			default: reader.skip();
+		}
+	}
+}
+
+PbfPrimitiveGroup::PbfPrimitiveGroup(PbfSlice message) {
+	PbfFieldReader reader(message);
+	while (reader.next()) {
+		switch (reader.field()) {
+			case 2: dense = PbfDenseNodes(reader.bytes()); hasDenseNodes = true; break;
+			case 3: ways.push_back(reader.bytes()); break;
+			case 4: relations.push_back(reader.bytes()); break;
+			default: reader.skip();
+		}
+	}
+}
+
+int PbfStringTable::find(char const *str) const {
+	for (size_t i=0; i<strings.size(); i++) {
+		if (strings[i] == str) return i;
+	}
+	return -1;
+}
+
+void PbfStringTable::read(PbfSlice message) {
+	PbfFieldReader reader(message);
+	while (reader.next()) {
+		if (reader.field() == 1) strings.push_back(reader.bytes());
+		else reader.skip();
+	}
+}
+
+PbfPrimitiveBlock::PbfPrimitiveBlock(char const *blob, size_t size)
+{
+	pbfReadBlob(blob, size, buffer);
+
+	PbfSlice message;
+	message.data = buffer.data();
+	message.size = buffer.size();
+
+	PbfFieldReader reader(message);
+	while (reader.next()) {
+		switch (reader.field()) {
+			case 1: strings.read(reader.bytes()); break;
+			case 2: primitiveGroups.emplace_back(reader.bytes()); break;
+			default: reader.skip();
+		}
+	}
+}
+
+size_t PbfPrimitiveBlock::memoryUsed() const {
+	size_t used = sizeof(*this) + buffer.capacity() + strings.size() * sizeof(PbfSlice);
+	for (auto const &group : primitiveGroups) {
+		used += sizeof(group) + (group.ways.size() + group.relations.size()) * sizeof(PbfSlice);
+	}
+	return used;
+}
+
+#ifdef HAVE_ZSTD
+static void readZstdBlob(PbfSlice data, size_t rawSize, string &out) {
+	// One decompression context per thread, reused for every blob it reads
+	static thread_local unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx *)> context(ZSTD_createDCtx(), ZSTD_freeDCtx);
+
+	if (rawSize == 0) {
+		unsigned long long frameSize = ZSTD_getFrameContentSize(data.data, data.size);
+		if (frameSize == ZSTD_CONTENTSIZE_UNKNOWN || frameSize == ZSTD_CONTENTSIZE_ERROR)
+			throw runtime_error("zstd blob in .pbf has no raw_size");
+		if (frameSize > maxBlobSize) throw runtime_error("zstd blob in .pbf is larger than the format allows");
+		rawSize = static_cast<size_t>(frameSize);
+	}
+	out.resize(rawSize);
+	size_t result = ZSTD_decompressDCtx(context.get(), &out[0], out.size(), data.data, data.size);
+	if (ZSTD_isError(result)) throw runtime_error(string("Couldn't decompress zstd blob in .pbf: ") + ZSTD_getErrorName(result));
+	out.resize(result);
+}
+#endif
+
+#ifdef HAVE_LZ4
+static void readLz4Blob(PbfSlice data, size_t rawSize, string &out) {
+	// Raw LZ4 blocks don't record their uncompressed size, so the Blob's raw_size is required
+	if (rawSize == 0) throw runtime_error("lz4 blob in .pbf has no raw_size");
+	// Both sizes are within the format's limit, so they fit LZ4's int arguments
+	if (data.size > maxBlobSize) throw runtime_error("lz4 blob in .pbf is larger than the format allows");
+	out.resize(rawSize);
+	int result = LZ4_decompress_safe(data.data, &out[0], static_cast<int>(data.size), static_cast<int>(rawSize));
+	if (result < 0) throw runtime_error("Couldn't decompress lz4 blob in .pbf");
+	out.resize(result);
+}
+#endif
+
+void pbfReadBlob(char const *data, size_t size, string &out) {
+	PbfSlice message;
+	message.data = data;
+	message.size = size;
+
+	PbfSlice raw, zlibData, lzmaData, lz4Data, zstdData;
+	size_t rawSize = 0;
+	PbfFieldReader reader(message);
+	while (reader.next()) {
+		switch (reader.field()) {
+			case 1: raw      = reader.bytes(); break;
+			case 2: rawSize  = static_cast<size_t>(reader.varint()); break;
+			case 3: zlibData = reader.bytes(); break;
+			case 4: lzmaData = reader.bytes(); break;
+			case 6: lz4Data  = reader.bytes(); break;
+			case 7: zstdData = reader.bytes(); break;
+			default: reader.skip();
+		}
+	}
+
+	if (rawSize > maxBlobSize) throw runtime_error("Blob in .pbf is larger than the format allows");
+
+	if (!zlibData.empty()) { ZlibContext::forThread().decompress(zlibData.data, zlibData.size, out, false, rawSize); return; }
+	if (!zstdData.empty()) {
+#ifdef HAVE_ZSTD
+		readZstdBlob(zstdData, rawSize, out); return;
+#else
+		throw runtime_error("This .pbf uses zstd compression, but tilemaker was built without zstd support");
+#endif
+	}
+	if (!lz4Data.empty()) {
+#ifdef HAVE_LZ4
+		readLz4Blob(lz4Data, rawSize, out); return;
+#else
+		throw runtime_error("This .pbf uses lz4 compression, but tilemaker was built without lz4 support");
+#endif
+	}
+	if (!lzmaData.empty()) throw runtime_error("lzma-compressed .pbf blobs are not supported");
+	out.assign(raw.data, raw.size);
+}
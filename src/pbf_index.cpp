@@ -0,0 +1,92 @@
+#include "pbf_index.h"
+#include <cstring>
+#include <fstream>
+#include <boost/filesystem.hpp>
+using namespace std;
+
+// Host byte order; the index is a local cache rather than an interchange format
+static const char indexMagic[8] = { 'T', 'M', 'P', 'B', 'F', 'I', 'X', '4' };
+
+template<typename T>
+static void writeValue(ostream &out, T value) {
+	out.write(reinterpret_cast<char const *>(&value), sizeof(value));
+}
+
+template<typename T>
+static bool readValue(istream &in, T &value) {
+	in.read(reinterpret_cast<char *>(&value), sizeof(value));
+	return static_cast<bool>(in);
+}
+
+bool PbfBlockIndex::load(string const &pbfFile) {
+	blocks.clear();
+	loaded = false;
+	boost::system::error_code ec;
+	uint64_t fileSize = boost::filesystem::file_size(pbfFile, ec);
+	if (ec) return false;
+	int64_t modified = boost::filesystem::last_write_time(pbfFile, ec);
+	if (ec) return false;
+
+	ifstream in(indexFile(pbfFile), ios::in | ios::binary);
+	if (!in) return false;
+
+	char magic[sizeof(indexMagic)];
+	uint64_t storedSize, count;
+	int64_t storedModified;
+	in.read(magic, sizeof(magic));
+	if (!in || memcmp(magic, indexMagic, sizeof(magic)) != 0) return false;
+	if (!readValue(in, storedSize) || !readValue(in, storedModified) || !readValue(in, count)) return false;
+	if (storedSize != fileSize || storedModified != modified) return false;
+
+	blocks.reserve(count);
+	for (uint64_t i=0; i<count; i++) {
+		Block block;
+		if (!readValue(in, block.headerOffset) || !readValue(in, block.offset) || !readValue(in, block.length) || !readValue(in, block.phases) ||
+		    block.headerOffset >= block.offset || block.offset + block.length > fileSize) {
+			blocks.clear();
+			return false;
+		}
+		blocks.push_back(block);
+	}
+	loaded = true;
+	return true;
+}
+
+bool PbfBlockIndex::save(string const &pbfFile) const {
+	boost::system::error_code ec;
+	uint64_t fileSize = boost::filesystem::file_size(pbfFile, ec);
+	if (ec) return false;
+	int64_t modified = boost::filesystem::last_write_time(pbfFile, ec);
+	if (ec) return false;
+
+	// Write to a temporary file and rename, so an interrupted run never leaves a partial index;
+	// the name is unique, so runs on the same .pbf at once don't write into each other's file
+	string filename = indexFile(pbfFile);
+	string tmpFilename = boost::filesystem::unique_path(filename + ".%%%%%%", ec).string();
+	if (ec) return false;
+	{
+		ofstream out(tmpFilename, ios::out | ios::binary | ios::trunc);
+		if (!out) return false;
+		out.write(indexMagic, sizeof(indexMagic));
+		writeValue<uint64_t>(out, fileSize);
+		writeValue<int64_t>(out, modified);
+		writeValue<uint64_t>(out, blocks.size());
+		for (Block const &block : blocks) {
+			writeValue(out, block.headerOffset);
+			writeValue(out, block.offset);
+			writeValue(out, block.length);
+			writeValue(out, block.phases);
+		}
+		if (!out) {
+			out.close();
+			boost::filesystem::remove(tmpFilename, ec);
+			return false;
+		}
+	}
+	boost::filesystem::rename(tmpFilename, filename, ec);
+	if (ec) {
+		boost::filesystem::remove(tmpFilename, ec);
+		return false;
+	}
+	return true;
+}
@@ -1,112 +1,291 @@
 #include <iostream>
 #include "read_pbf.h"
 #include "pbf_blocks.h"
+#include "bounded_queue.h"
 
-#include <boost/interprocess/streams/bufferstream.hpp>
-#include <boost/asio/thread_pool.hpp>
-#include <boost/asio/post.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <thread>
 #include <unordered_set>
 
 #include "osm_lua_processing.h"
 
 using namespace std;
 
+PbfBlockCache::block_ptr PbfBlockCache::get(std::size_t index) const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = blocks.find(index);
+	if (it == blocks.end()) return nullptr;
+	return it->second.first;
+}
+
+bool PbfBlockCache::put(std::size_t index, block_ptr const &block, std::size_t blockSize)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (blocks.find(index) != blocks.end()) return true;
+	if (usedSize + blockSize > maxSize) return false;
+	blocks.emplace(index, std::make_pair(block, blockSize));
+	usedSize += blockSize;
+	return true;
+}
+
+void PbfBlockCache::erase(std::size_t index)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = blocks.find(index);
+	if (it == blocks.end()) return;
+	usedSize -= it->second.second;
+	blocks.erase(it);
+}
+
 PbfReader::PbfReader(OSMStore &osmStore)
-	: osmStore(osmStore)
+	: osmStore(osmStore), blockCacheSize(0), onlyUsedNodes(false)
 { }
 
-bool PbfReader::ReadNodes(OsmLuaProcessing &output, PrimitiveGroup &pg, PrimitiveBlock const &pb, const unordered_set<int> &nodeKeyPositions)
+PbfReader::~PbfReader()
+{
+	ClearOutputs();
+}
+
+void PbfReader::ClearOutputs()
+{
+	std::lock_guard<std::mutex> lock(outputsMutex);
+	idleOutputs.clear();
+	outputs.clear();
+}
+
+OsmLuaProcessing &PbfReader::acquireOutput(pbfreader_generate_output const &generate_output)
+{
+	{
+		std::lock_guard<std::mutex> lock(outputsMutex);
+		if (!idleOutputs.empty()) {
+			OsmLuaProcessing *output = idleOutputs.back();
+			idleOutputs.pop_back();
+			return *output;
+		}
+	}
+
+	// Start the new Lua state outside the lock, it runs the whole profile
+	std::unique_ptr<OsmLuaProcessing> output = generate_output();
+	OsmLuaProcessing *result = output.get();
+	std::lock_guard<std::mutex> lock(outputsMutex);
+	outputs.push_back(std::move(output));
+	return *result;
+}
+
+void PbfReader::releaseOutput(OsmLuaProcessing &output)
+{
+	std::lock_guard<std::mutex> lock(outputsMutex);
+	idleOutputs.push_back(&output);
+}
+
+bool PbfReader::readDenseTags(PbfPackedInt32::const_iterator &kv, PbfPackedInt32::const_iterator kvEnd, BlockTagKeys &keys, const unordered_set<int> &nodeKeyPositions, TagList &tags)
+{
+	bool significant = false;
+	auto start = kv;
+	while (kv != kvEnd && *kv > 0) {
+		if (nodeKeyPositions.find(*kv) != nodeKeyPositions.end()) {
+			significant = true;
+		}
+		++kv;
+		if (kv != kvEnd) ++kv;
+	}
+	if (kv != kvEnd) ++kv;
+	if (!significant) return false;
+
+	PbfStringTable const &strings = keys.stringTable();
+	tags.clear();
+	while (start != kvEnd && *start > 0) {
+		int32_t key = *start;
+		++start;
+		if (start == kvEnd) break;
+		tags.add(keys(key), strings[key], strings[*start]);
+		++start;
+	}
+	return true;
+}
+
+bool PbfReader::ReadNodes(OsmLuaProcessing &output, PbfPrimitiveGroup const &pg, PbfPrimitiveBlock const &pb, std::size_t segment, BlockTagKeys &keys, const unordered_set<int> &nodeKeyPositions, bool locationsOnWays, bool usedNodesOnly)
 {
 	// ----	Read nodes
 
-	if (pg.has_dense()) {
+	if (pg.hasDense() && locationsOnWays) {
+		ReadSignificantNodes(output, pg, keys, nodeKeyPositions);
+		return true;
+	}
+
+	if (pg.hasDense()) {
 		int64_t nodeId  = 0;
-		int lon = 0;
-		int lat = 0;
-		int kvPos = 0;
-		DenseNodes dense = pg.dense();
-
-		std::vector<NodeStore::element_t> nodes;		
-		for (int j=0; j<dense.id_size(); j++) {
-			nodeId += dense.id(j);
-			lon    += dense.lon(j);
-			lat    += dense.lat(j);
-			LatpLon node = { int(lat2latp(double(lat)/10000000.0)*10000000.0), lon };
-
-			bool significant = false;
-			int kvStart = kvPos;
-			if (dense.keys_vals_size()>0) {
-				while (dense.keys_vals(kvPos)>0) {
-					if (nodeKeyPositions.find(dense.keys_vals(kvPos)) != nodeKeyPositions.end()) {
-						significant = true;
-					}
-					kvPos+=2;
-				}
-				kvPos++;
+		PbfDenseNodes const &dense = pg.dense;
+
+		// Decode the coordinate deltas for the whole group, then project them in one batch
+		static thread_local std::vector<int64_t> latDeltas, lonDeltas;
+		static thread_local std::vector<LatpLon> locations;
+		latDeltas.assign(dense.lats.begin(), dense.lats.end());
+		lonDeltas.assign(dense.lons.begin(), dense.lons.end());
+		size_t count = std::min(latDeltas.size(), lonDeltas.size());
+		locations.resize(count);
+		projectDeltaCoordinates(latDeltas.data(), lonDeltas.data(), count, locations.data());
+
+		auto idIt = dense.ids.begin(), idEnd = dense.ids.end();
+		auto kvIt = dense.keysVals.begin(), kvEnd = dense.keysVals.end();
+
+		std::vector<NodeStore::element_t> nodes;
+		nodes.reserve(count);
+		TagList tags;
+		for (size_t i = 0; idIt != idEnd && i < count; ++idIt, ++i) {
+			nodeId += *idIt;
+			LatpLon node = locations[i];
+
+			bool significant = readDenseTags(kvIt, kvEnd, keys, nodeKeyPositions, tags);
+
+			// Ways will only look up the nodes they were found to use
+			if (!usedNodesOnly || osmStore.node_is_used(static_cast<NodeID>(nodeId))) {
+				nodes.push_back(std::make_pair(static_cast<NodeID>(nodeId), node));
 			}
-			// For tagged nodes, call Lua, then save the OutputObject
-			boost::container::flat_map<std::string, std::string> tags;
-
-			nodes.push_back(std::make_pair(static_cast<NodeID>(nodeId), node));
 
+			// For tagged nodes, call Lua, then save the OutputObject
 			if (significant) {
-				for (uint n=kvStart; n<kvPos-1; n+=2) {
-					tags[pb.stringtable().s(dense.keys_vals(n))] = pb.stringtable().s(dense.keys_vals(n+1));
-				}
 				output.setNode(static_cast<NodeID>(nodeId), node, tags);
 			} 
 
 		}
 
-		osmStore.nodes_insert_back(nodes);
+		osmStore.nodes_insert_back(segment, nodes);
 		return true;
 	}
 	return false;
 }
 
-bool PbfReader::ReadWays(OsmLuaProcessing &output, PrimitiveGroup &pg, PrimitiveBlock const &pb, bool locationsOnWays) {
+void PbfReader::ReadSignificantNodes(OsmLuaProcessing &output, PbfPrimitiveGroup const &pg, BlockTagKeys &keys, const unordered_set<int> &nodeKeyPositions)
+{
+	// Nothing is stored, so only nodes with significant tags need their location
+	bool anyKeys = false;
+	for (int position : nodeKeyPositions) { if (position > 0) anyKeys = true; }
+	if (!anyKeys) return;
+
+	PbfDenseNodes const &dense = pg.dense;
+	int64_t nodeId = 0, lat = 0, lon = 0;
+	auto idIt = dense.ids.begin(), idEnd = dense.ids.end();
+	auto latIt = dense.lats.begin(), latEnd = dense.lats.end();
+	auto lonIt = dense.lons.begin(), lonEnd = dense.lons.end();
+	auto kvIt = dense.keysVals.begin(), kvEnd = dense.keysVals.end();
+
+	TagList tags;
+	for (; idIt != idEnd && latIt != latEnd && lonIt != lonEnd; ++idIt, ++latIt, ++lonIt) {
+		nodeId += *idIt;
+		lat += *latIt;
+		lon += *lonIt;
+
+		if (!readDenseTags(kvIt, kvEnd, keys, nodeKeyPositions, tags)) continue;
+
+		LatpLon node;
+		projectDeltaCoordinates(&lat, &lon, 1, &node);
+		output.setNode(static_cast<NodeID>(nodeId), node, tags);
+	}
+}
+
+bool PbfReader::ScanWays(PbfPrimitiveGroup const &pg) {
+	// ----	Mark the nodes used by ways
+
+	if (pg.ways.size() == 0) return false;
+
+	std::vector<NodeID> refs;
+	for (PbfSlice const &waySlice : pg.ways) {
+		PbfWay pbfWay(waySlice);
+		int64_t nodeId = 0;
+		for (int64_t refDelta : pbfWay.refs) {
+			nodeId += refDelta;
+			refs.push_back(static_cast<NodeID>(nodeId));
+		}
+	}
+	osmStore.mark_nodes_used(refs);
+	return true;
+}
+
+bool PbfReader::ReadWays(OsmLuaProcessing &output, PbfPrimitiveGroup const &pg, PbfPrimitiveBlock const &pb, std::size_t segment, BlockTagKeys &keys, bool locationsOnWays, KeyFilter const &wayFilter) {
 	// ----	Read ways
 
-	if (pg.ways_size() > 0) {
-		Way pbfWay;
+	if (pg.ways.size() > 0) {
+		std::vector<WayStore::input_t> ways;
+		TagList tags;
 
-		std::vector<WayStore::element_t> ways;
+		// Ways we need to read, and whether Lua needs them (significant) or a relation does (used)
+		struct WayToRead { PbfWay way; bool significant; bool used; size_t firstRef; };
+		std::vector<WayToRead> toRead;
+		toRead.reserve(pg.ways.size());
 
-		for (int j=0; j<pg.ways_size(); j++) {
-			pbfWay = pg.ways(j);
-			WayID wayId = static_cast<WayID>(pbfWay.id());
+		// Refs of all those ways, resolved together so the node store is searched in one forward pass
+		static thread_local std::vector<NodeID> refs, refIds;
+		static thread_local std::vector<LatpLon> resolved;
+		static thread_local std::vector<bool> resolvedFound;
+		refs.clear();
+
+		for (PbfSlice const &waySlice : pg.ways) {
+			PbfWay pbfWay(waySlice);
+			WayID wayId = static_cast<WayID>(pbfWay.id);
+
+			// Ways without any of the way_keys are only read if a relation needs them
+			bool significant = wayFilter.matches(pbfWay);
+			bool used = osmStore.way_is_used(wayId);
+			if (!significant && !used) continue;
+
+			toRead.push_back({ pbfWay, significant, used, refs.size() });
+			if (!locationsOnWays) {
+				int64_t nodeId = 0;
+				for (int64_t refDelta : pbfWay.refs) {
+					nodeId += refDelta;
+					refs.push_back(static_cast<NodeID>(nodeId));
+				}
+			}
+		}
+
+		if (!locationsOnWays) {
+			// Sort and deduplicate the refs, and look them up
+			refIds.assign(refs.begin(), refs.end());
+			std::sort(refIds.begin(), refIds.end());
+			refIds.erase(std::unique(refIds.begin(), refIds.end()), refIds.end());
+			osmStore.nodes_at(refIds, resolved, resolvedFound);
+		}
+
+		for (size_t w = 0; w < toRead.size(); w++) {
+			PbfWay const &pbfWay = toRead[w].way;
+			WayID wayId = static_cast<WayID>(pbfWay.id);
+			bool significant = toRead[w].significant;
+			bool used = toRead[w].used;
 
 			// Assemble nodelist
 			LatpLonVec llVec;
 			if (locationsOnWays) {
-				int lat=0, lon=0;
-				for (int k=0; k<pbfWay.lats_size(); k++) {
-					lat += pbfWay.lats(k);
-					lon += pbfWay.lons(k);
-					LatpLon ll = { int(lat2latp(double(lat)/10000000.0)*10000000.0), lon };
-					llVec.push_back(ll);
-				}
+				static thread_local std::vector<int64_t> latDeltas, lonDeltas;
+				latDeltas.assign(pbfWay.lats.begin(), pbfWay.lats.end());
+				lonDeltas.assign(pbfWay.lons.begin(), pbfWay.lons.end());
+				llVec.resize(std::min(latDeltas.size(), lonDeltas.size()));
+				projectDeltaCoordinates(latDeltas.data(), lonDeltas.data(), llVec.size(), llVec.data());
 			} else {
-				int64_t nodeId = 0;
-				for (int k=0; k<pbfWay.refs_size(); k++) {
-					nodeId += pbfWay.refs(k);
-					try {
-						llVec.push_back(osmStore.nodes_at(static_cast<NodeID>(nodeId)));
-					} catch (std::out_of_range &err) {
-						if (osmStore.integrity_enforced()) throw err;
+				size_t refEnd = w + 1 < toRead.size() ? toRead[w + 1].firstRef : refs.size();
+				llVec.reserve(refEnd - toRead[w].firstRef);
+				for (size_t n = toRead[w].firstRef; n < refEnd; n++) {
+					// Scatter the resolved locations back into this way's node list
+					size_t r = std::lower_bound(refIds.begin(), refIds.end(), refs[n]) - refIds.begin();
+					if (resolvedFound[r]) {
+						llVec.push_back(resolved[r]);
+					} else if (osmStore.integrity_enforced()) {
+						throw std::out_of_range("Could not find node with id " + std::to_string(refs[n]));
 					}
 				}
 			}
 
 			try {
-				tag_map_t tags;
-				readTags(pbfWay, pb, tags);
-
 				// If we need it for later, store the way's coordinates in the global way store
-				if (osmStore.way_is_used(wayId)) {
-					ways.push_back(std::make_pair(wayId, WayStore::latplon_vector_t(llVec.begin(), llVec.end())));
+				if (used) {
+					ways.push_back(std::make_pair(wayId, llVec));
+				}
+				if (significant) {
+					readTags(pbfWay, keys, tags);
+					output.setWay(wayId, llVec, tags);
 				}
-				output.setWay(static_cast<WayID>(pbfWay.id()), llVec, tags);
 
 			} catch (std::out_of_range &err) {
 				// Way is missing a node?
@@ -115,47 +294,60 @@ bool PbfReader::ReadWays(OsmLuaProcessing &output, PrimitiveGroup &pg, Primitive
 
 		}
 
-		osmStore.ways_insert_back(ways);
+		osmStore.ways_insert_back(segment, ways);
 		return true;
 	}
 	return false;
 }
 
-bool PbfReader::ScanRelations(OsmLuaProcessing &output, PrimitiveGroup &pg, PrimitiveBlock const &pb) {
+// Does this relation have type=multipolygon?
+static bool relationIsMultiPolygon(PbfRelation const &pbfRelation, int typeKey, int mpKey) {
+	if (typeKey < 0 || mpKey < 0) return false;
+	return (find(pbfRelation.keys.begin(), pbfRelation.keys.end(), static_cast<uint32_t>(typeKey)) != pbfRelation.keys.end()) &&
+	       (find(pbfRelation.vals.begin(), pbfRelation.vals.end(), static_cast<uint32_t>(mpKey)  ) != pbfRelation.vals.end());
+}
+
+bool PbfReader::ScanRelations(OsmLuaProcessing &output, PbfPrimitiveGroup const &pg, PbfPrimitiveBlock const &pb, BlockTagKeys &keys, KeyFilter const &relationFilter) {
 	// Scan relations to see which ways we need to save
-	if (pg.relations_size()==0) return false;
+	if (pg.relations.size()==0) return false;
 
 	int typeKey = findStringPosition(pb, "type");
 	int mpKey   = findStringPosition(pb, "multipolygon");
 
-	for (int j=0; j<pg.relations_size(); j++) {
-		Relation pbfRelation = pg.relations(j);
-		bool isMultiPolygon = (find(pbfRelation.keys().begin(), pbfRelation.keys().end(), typeKey) != pbfRelation.keys().end()) &&
-		                      (find(pbfRelation.vals().begin(), pbfRelation.vals().end(), mpKey  ) != pbfRelation.vals().end());
+	TagList tags;
+	std::vector<WayID> memberWays;
+	for (PbfSlice const &relationSlice : pg.relations) {
+		PbfRelation pbfRelation(relationSlice);
 		bool isAccepted = false;
-		WayID relid = static_cast<WayID>(pbfRelation.id());
-		if (!isMultiPolygon) {
+		WayID relid = static_cast<WayID>(pbfRelation.id);
+		if (!relationIsMultiPolygon(pbfRelation, typeKey, mpKey)) {
 			if (!output.canReadRelations()) continue;
-			tag_map_t tags;
-			readTags(pbfRelation, pb, tags);
+			if (!relationFilter.matches(pbfRelation)) continue;
+			readTags(pbfRelation, keys, tags);
 			isAccepted = output.scanRelation(relid, tags);
 			if (!isAccepted) continue;
 		}
 		int64_t lastID = 0;
-		for (int n=0; n < pbfRelation.memids_size(); n++) {
-			lastID += pbfRelation.memids(n);
-			if (pbfRelation.types(n) != Relation_MemberType_WAY) { continue; }
+		memberWays.clear();
+		auto typeIt = pbfRelation.types.begin(), typeEnd = pbfRelation.types.end();
+		for (int64_t memidDelta : pbfRelation.memids) {
+			if (typeIt == typeEnd) break;
+			lastID += memidDelta;
+			int32_t type = *typeIt;
+			++typeIt;
+			if (type != PbfRelation::Way) { continue; }
 			osmStore.mark_way_used(static_cast<WayID>(lastID));
-			if (isAccepted) { osmStore.relation_contains_way(relid, lastID); }
+			if (isAccepted) { memberWays.push_back(static_cast<WayID>(lastID)); }
 		}
+		if (!memberWays.empty()) osmStore.relation_contains_ways(relid, memberWays);
 	}
 	return true;
 }
 
-bool PbfReader::ReadRelations(OsmLuaProcessing &output, PrimitiveGroup &pg, PrimitiveBlock const &pb) {
+bool PbfReader::ReadRelations(OsmLuaProcessing &output, PbfPrimitiveGroup const &pg, PbfPrimitiveBlock const &pb, std::size_t segment, BlockTagKeys &keys, KeyFilter const &wayFilter, KeyFilter const &relationFilter) {
 	// ----	Read relations
 
-	if (pg.relations_size() > 0) {
+	if (pg.relations.size() > 0) {
 		std::vector<RelationStore::element_t> relations;
 
 		int typeKey = findStringPosition(pb, "type");
@@ -163,19 +355,27 @@ bool PbfReader::ReadRelations(OsmLuaProcessing &output, PrimitiveGroup &pg, Prim
 		int innerKey= findStringPosition(pb, "inner");
 		//int outerKey= findStringPosition(pb, "outer");
 		if (typeKey >-1 && mpKey>-1) {
-			for (int j=0; j<pg.relations_size(); j++) {
-				Relation pbfRelation = pg.relations(j);
-				bool isMultiPolygon = (find(pbfRelation.keys().begin(), pbfRelation.keys().end(), typeKey) != pbfRelation.keys().end()) &&
-				                      (find(pbfRelation.vals().begin(), pbfRelation.vals().end(), mpKey  ) != pbfRelation.vals().end());
+			TagList tags;
+			for (PbfSlice const &relationSlice : pg.relations) {
+				PbfRelation pbfRelation(relationSlice);
+				bool isMultiPolygon = relationIsMultiPolygon(pbfRelation, typeKey, mpKey);
 				if (!isMultiPolygon && !output.canWriteRelations()) continue;
 
+				// Multipolygons go to way_function, other relations to relation_function
+				if (!(isMultiPolygon ? wayFilter : relationFilter).matches(pbfRelation)) continue;
+
 				// Read relation members
 				WayVec outerWayVec, innerWayVec;
 				int64_t lastID = 0;
-				for (int n=0; n < pbfRelation.memids_size(); n++) {
-					lastID += pbfRelation.memids(n);
-					if (pbfRelation.types(n) != Relation_MemberType_WAY) { continue; }
-					int32_t role = pbfRelation.roles_sid(n);
+				auto typeIt = pbfRelation.types.begin(), typeEnd = pbfRelation.types.end();
+				auto roleIt = pbfRelation.rolesSid.begin(), roleEnd = pbfRelation.rolesSid.end();
+				for (int64_t memidDelta : pbfRelation.memids) {
+					if (typeIt == typeEnd || roleIt == roleEnd) break;
+					lastID += memidDelta;
+					int32_t type = *typeIt;
+					int32_t role = *roleIt;
+					++typeIt; ++roleIt;
+					if (type != PbfRelation::Way) { continue; }
 					// if (role != innerKey && role != outerKey) { continue; }
 					// ^^^^ commented out so that we don't die horribly when a relation has no outer way
 					WayID wayId = static_cast<WayID>(lastID);
@@ -183,16 +383,15 @@ bool PbfReader::ReadRelations(OsmLuaProcessing &output, PrimitiveGroup &pg, Prim
 				}
 
 				try {
-					tag_map_t tags;
-					readTags(pbfRelation, pb, tags);
+					readTags(pbfRelation, keys, tags);
 
 					// Store the relation members in the global relation store
-					relations.push_back(std::make_pair(pbfRelation.id(), 
+					relations.push_back(std::make_pair(pbfRelation.id, 
 						std::make_pair(
 							RelationStore::wayid_vector_t(outerWayVec.begin(), outerWayVec.end()),
 							RelationStore::wayid_vector_t(innerWayVec.begin(), innerWayVec.end()))));
 
-					output.setRelation(pbfRelation.id(), outerWayVec, innerWayVec, tags, isMultiPolygon);
+					output.setRelation(pbfRelation.id, outerWayVec, innerWayVec, tags, isMultiPolygon);
 
 				} catch (std::out_of_range &err) {
 					// Relation is missing a member?
@@ -201,56 +400,73 @@ bool PbfReader::ReadRelations(OsmLuaProcessing &output, PrimitiveGroup &pg, Prim
 			}
 		}
 
-		osmStore.relations_insert_front(relations);
+		osmStore.relations_insert_front(segment, relations);
 		return true;
 	}
 	return false;
 }
 
-// Returns true when block was completely handled, thus could be omited by another phases.
-bool PbfReader::ReadBlock(std::istream &infile, OsmLuaProcessing &output, std::pair<std::size_t, std::size_t> progress, std::size_t datasize, 
-                          unordered_set<string> const &nodeKeys, bool locationsOnWays, ReadPhase phase) 
+unsigned int PbfReader::blockPhases(PbfPrimitiveBlock const &pb)
 {
-	PrimitiveBlock pb;
-	readBlock(&pb, datasize, infile);
-	if (infile.eof()) {
-		return true;
+	unsigned int phases = 0;
+	for (PbfPrimitiveGroup const &pg : pb.groups()) {
+		if (pg.hasDense())           { phases |= static_cast<unsigned int>(ReadPhase::Nodes); }
+		if (pg.ways.size() > 0)      { phases |= static_cast<unsigned int>(ReadPhase::WayScan) | static_cast<unsigned int>(ReadPhase::Ways); }
+		if (pg.relations.size() > 0) { phases |= static_cast<unsigned int>(ReadPhase::RelationScan) | static_cast<unsigned int>(ReadPhase::Relations); }
 	}
+	return phases;
+}
 
-	// Keep count of groups read during this phase.
-	std::size_t read_groups = 0;
-
+void PbfReader::ReadBlock(PbfPrimitiveBlock const &pb, OsmLuaProcessing &output, std::pair<std::size_t, std::size_t> progress, 
+                          unordered_set<string> const &nodeKeys, bool locationsOnWays, bool usedNodesOnly, ReadPhase phase) 
+{
 	// Read the string table, and pre-calculate the positions of valid node keys
 	unordered_set<int> nodeKeyPositions;
-	for (auto it : nodeKeys) {
-		nodeKeyPositions.insert(findStringPosition(pb, it.c_str()));
+	if (phase == ReadPhase::Nodes || phase == ReadPhase::All) {
+		for (auto it : nodeKeys) {
+			nodeKeyPositions.insert(findStringPosition(pb, it.c_str()));
+		}
+	}
+
+	BlockTagKeys keys(pb.stringTable());
+	KeyFilter wayFilter, relationFilter;
+	if (phase == ReadPhase::Ways || phase == ReadPhase::Relations || phase == ReadPhase::All) {
+		wayFilter = keyFilter(pb, wayKeys);
+	}
+	if (phase == ReadPhase::RelationScan || phase == ReadPhase::Relations || phase == ReadPhase::All) {
+		relationFilter = keyFilter(pb, relationKeys);
 	}
 
-	for (int i=0; i<pb.primitivegroup_size(); i++) {
-		PrimitiveGroup pg;
-		pg = pb.primitivegroup(i);
+	for (PbfPrimitiveGroup const &pg : pb.groups()) {
 	
 		auto output_progress = [&]()
 		{
 			std::ostringstream str;
 			osmStore.reportStoreSize(str);
-			str << "Block " << progress.first << "/" << progress.second << " ways " << pg.ways_size() << " relations " << pg.relations_size() << "        \r";
+			str << "Block " << progress.first << "/" << progress.second << " ways " << pg.ways.size() << " relations " << pg.relations.size() << "        \r";
 			std::cout << str.str();
 			std::cout.flush();
 		};
 
+		if(phase == ReadPhase::WayScan) {
+			bool done = ScanWays(pg);
+			if(done) { 
+				std::cout << "(Scanning for nodes used in ways: " << (100*progress.first/progress.second) << "%)\r";
+				std::cout.flush();
+				continue;
+			}
+		}
+
 		if(phase == ReadPhase::Nodes || phase == ReadPhase::All) {
-			bool done = ReadNodes(output, pg, pb, nodeKeyPositions);
+			bool done = ReadNodes(output, pg, pb, progress.first, keys, nodeKeyPositions, locationsOnWays, usedNodesOnly);
 			if(done) { 
 				output_progress();
-				++read_groups;
 				continue;
 			}
 		}
 
 		if(phase == ReadPhase::RelationScan || phase == ReadPhase::All) {
-			osmStore.ensure_used_ways_inited();
-			bool done = ScanRelations(output, pg, pb);
+			bool done = ScanRelations(output, pg, pb, keys, relationFilter);
 			if(done) { 
 				std::cout << "(Scanning for ways used in relations: " << (100*progress.first/progress.second) << "%)\r";
 				std::cout.flush();
@@ -259,120 +475,301 @@ bool PbfReader::ReadBlock(std::istream &infile, OsmLuaProcessing &output, std::p
 		}
 	
 		if(phase == ReadPhase::Ways || phase == ReadPhase::All) {
-			bool done = ReadWays(output, pg, pb, locationsOnWays);
+			bool done = ReadWays(output, pg, pb, progress.first, keys, locationsOnWays, wayFilter);
 			if(done) { 
 				output_progress();
-				++read_groups;
 				continue;
 			}
 		}
 
 		if(phase == ReadPhase::Relations || phase == ReadPhase::All) {
-			bool done = ReadRelations(output, pg, pb);
+			bool done = ReadRelations(output, pg, pb, progress.first, keys, wayFilter, relationFilter);
 			if(done) { 
 				output_progress();
-				++read_groups;
 				continue;
 			}
 		}
 	}
+}
 
-	// Possible cases of a block contents:
-	// - single group
-	// - multiple groups of the same type
-	// - multiple groups of the different type
-	// 
-	// In later case block would not be handled during this phase, and should be
-	// read again in remaining phases. Thus we return false to indicate that the
-	// block was not handled completelly.
-	if(read_groups != pb.primitivegroup_size()) {
-		return false;
+bool PbfReader::indexMatches(PbfBlockIndex const &index, char const *data, std::size_t size)
+{
+	// The index is keyed on the file's size and modification time, which don't catch every
+	// change (a same-size file replaced within a second, or copied with its times), so
+	// check each block's header is where the index says before trusting any offsets
+	BlobHeader bh;
+	for (auto const &entry : index.blocks) {
+		std::size_t offset = static_cast<std::size_t>(entry.headerOffset);
+		if (!readHeader(bh, data, size, offset)) return false;
+		if (bh.type() != "OSMData" || offset != entry.offset || static_cast<uint64_t>(bh.datasize()) != entry.length) return false;
 	}
-
 	return true;
 }
 
 int PbfReader::ReadPbfFile(unordered_set<string> const &nodeKeys, unsigned int threadNum, 
-		pbfreader_generate_stream const &generate_stream, pbfreader_generate_output const &generate_output)
+		char const *data, std::size_t size, PbfBlockIndex *index, pbfreader_generate_output const &generate_output)
 {
-	auto infile = generate_stream();
-
 	// ----	Read PBF
 	osmStore.clear();
 
+	std::size_t offset = 0;
+	BlobHeader bh;
+	if (!readHeader(bh, data, size, offset)) {
+		cerr << "Couldn't read .pbf header" << endl;
+		return -1;
+	}
 	HeaderBlock block;
-	readBlock(&block, readHeader(*infile).datasize(), *infile);
+	readBlock(&block, data + offset, bh.datasize());
+	offset += bh.datasize();
 	bool locationsOnWays = false;
+	bool sortedFile = false;
 	for (std::string option : block.optional_features()) {
 		if (option=="LocationsOnWays") {
 			std::cout << ".osm.pbf file has locations on ways" << std::endl;
 			locationsOnWays = true;
 		}
+		if (option=="Sort.Type_then_ID") {
+			sortedFile = true;
+		}
 	}
 
-	std::map<std::size_t, std::pair< std::size_t, std::size_t> > blocks;
-
-	while (true) {
-		BlobHeader bh = readHeader(*infile);
-		if (infile->eof()) {
-			break;
+	// Offset (into data), length and the phases which still have to visit each block.
+	// Until a block has been decoded once, we don't know what it contains, so every phase is pending.
+	struct BlockInfo {
+		std::size_t offset;
+		std::size_t length;
+		unsigned int phases;
+		bool classified;
+	};
+	std::map<std::size_t, BlockInfo> blocks;
+
+	// Ways carry their own coordinates in LocationsOnWays files, so nodes aren't stored at all:
+	// the node phase is only needed to pass significant nodes to Lua, if there are any
+	bool usedNodesOnly = onlyUsedNodes && !locationsOnWays;
+	std::vector<ReadPhase> all_phases = { ReadPhase::Nodes, ReadPhase::RelationScan, ReadPhase::Ways, ReadPhase::Relations };
+	if (locationsOnWays && nodeKeys.empty()) all_phases.erase(all_phases.begin());
+	if (usedNodesOnly) all_phases.insert(all_phases.begin(), ReadPhase::WayScan);
+	unsigned int activePhases = 0;
+	for (ReadPhase phase : all_phases) activePhases |= static_cast<unsigned int>(phase);
+
+	// Use the block index if we have one, otherwise walk the headers (and build the index as we read)
+	bool indexed = index && !index->blocks.empty();
+	if (indexed && !indexMatches(*index, data, size)) {
+		std::cout << "Block index doesn't match the .pbf, so rebuilding it" << std::endl;
+		index->blocks.clear();
+		index->loaded = false;
+		indexed = false;
+	}
+	if (indexed) {
+		for (auto const &entry : index->blocks) {
+			blocks[blocks.size()] = { static_cast<std::size_t>(entry.offset), static_cast<std::size_t>(entry.length), entry.phases & activePhases, true };
+		}
+	} else {
+		std::vector<std::size_t> headerOffsets;
+		for (std::size_t headerOffset = offset; readHeader(bh, data, size, offset); headerOffset = offset) {
+			headerOffsets.push_back(headerOffset);
+			blocks[blocks.size()] = { offset, static_cast<std::size_t>(bh.datasize()), activePhases, false };
+			offset += bh.datasize();
+		}
+		if (index) {
+			for (auto const &block : blocks) {
+				index->blocks.push_back({ headerOffsets[block.first], block.second.offset, block.second.length, block.second.phases });
+			}
 		}
-
-		blocks[blocks.size()] = std::make_pair(infile->tellg(), bh.datasize());
-		infile->seekg(bh.datasize(), std::ios_base::cur);
-		
 	}
 
 
 	std::mutex block_mutex;
+	PbfBlockCache cache(blockCacheSize);
 
 	std::size_t total_blocks = blocks.size();
 
-	std::vector<ReadPhase> all_phases = { ReadPhase::Nodes, ReadPhase::RelationScan, ReadPhase::Ways, ReadPhase::Relations };
-	for(auto phase: all_phases) {
-		// Launch the pool with threadNum threads
-		boost::asio::thread_pool pool(threadNum);
+	// Each block writes its nodes, ways and relations to its own segment of the store
+	osmStore.reserve_segments(total_blocks);
+
+	// Blocks go through a three-stage pipeline:
+	//   - one reader walks the blocks for each phase in file order, paging them in from disk;
+	//   - inflaters decompress and index them (or take them from the cache);
+	//   - workers run them through Lua.
+	// Bounded queues between the stages keep all three busy at once. Workers must finish one
+	// phase (and the store be sorted) before starting the next, but the reader and inflaters
+	// move on to the next phase as soon as they're done, so its first blocks are ready when it opens.
+	struct RawBlock {
+		std::size_t phaseNum;
+		std::size_t index;
+		BlockInfo info;
+	};
+	struct DecodedBlock {
+		std::size_t phaseNum;
+		std::size_t index;
+		PbfBlockCache::block_ptr pb;
+	};
+
+	// Progress of each phase through the pipeline
+	std::mutex state_mutex;
+	std::condition_variable state_changed;
+	std::vector<std::size_t> dispatched(all_phases.size(), 0), decoded(all_phases.size(), 0), processed(all_phases.size(), 0);
+	std::vector<bool> dispatchDone(all_phases.size(), false);
+	std::size_t openPhase = 0;
+
+	unsigned int inflateThreads = std::max(1u, threadNum / 2);
+	BoundedQueue<RawBlock> rawQueue(4 * threadNum);
+	BoundedQueue<DecodedBlock> decodedQueue(2 * threadNum);
+
+	std::thread reader([&]() {
+		for (std::size_t phaseNum = 0; phaseNum < all_phases.size(); phaseNum++) {
+			// Until the previous phase's blocks have all been decoded, we may not know which blocks this phase needs
+			if (phaseNum > 0) {
+				std::unique_lock<std::mutex> lock(state_mutex);
+				state_changed.wait(lock, [&]() { return dispatchDone[phaseNum-1] && decoded[phaseNum-1] == dispatched[phaseNum-1]; });
+			}
 
-		{
-			const std::lock_guard<std::mutex> lock(block_mutex);
-			for(auto const &block: blocks) {
-				boost::asio::post(pool, [=, progress=std::make_pair(block.first, total_blocks), block=block.second, &blocks, &block_mutex, &nodeKeys]() {
-					auto infile = generate_stream();
-					auto output = generate_output();
-
-					infile->seekg(block.first);
-					if(ReadBlock(*infile, *output, progress, block.second, nodeKeys, locationsOnWays, phase)) {
+			std::vector<std::pair<std::size_t, BlockInfo>> phaseBlocks;
+			{
+				const std::lock_guard<std::mutex> lock(block_mutex);
+				for (auto const &block : blocks) {
+					if (block.second.phases & static_cast<unsigned int>(all_phases[phaseNum])) phaseBlocks.push_back(block);
+				}
+			}
+
+			for (auto const &block : phaseBlocks) {
+				if (!cache.get(block.first)) { pageIn(data + block.second.offset, block.second.length); }
+				{
+					const std::lock_guard<std::mutex> lock(state_mutex);
+					dispatched[phaseNum]++;
+				}
+				rawQueue.push({ phaseNum, block.first, block.second });
+			}
+
+			const std::lock_guard<std::mutex> lock(state_mutex);
+			dispatchDone[phaseNum] = true;
+			state_changed.notify_all();
+		}
+		rawQueue.close();
+	});
+
+	std::atomic<unsigned int> inflatersRunning(inflateThreads);
+	std::vector<std::thread> inflaters;
+	for (unsigned int i = 0; i < inflateThreads; i++) {
+		inflaters.emplace_back([&]() {
+			RawBlock raw;
+			while (rawQueue.pop(raw)) {
+				// Use the decoded block from an earlier phase if we kept it, otherwise decode it
+				PbfBlockCache::block_ptr pb = cache.get(raw.index);
+				if (!pb) {
+					pb = std::make_shared<PbfPrimitiveBlock>(data + raw.info.offset, raw.info.length);
+
+					// Now we know what's in the block, record which phases need it, and keep it if a later one does
+					unsigned int later;
+					{
 						const std::lock_guard<std::mutex> lock(block_mutex);
-						blocks.erase(progress.first);	
+						auto &info = blocks.at(raw.index);
+						if (!info.classified) {
+							unsigned int phases = blockPhases(*pb);
+							info.phases = phases & activePhases;
+							info.classified = true;
+							if (index) {
+								index->blocks[raw.index].phases = phases;
+							}
+						}
+						later = info.phases & ~static_cast<unsigned int>(all_phases[raw.phaseNum]);
 					}
-				});
+					if (later) cache.put(raw.index, pb, pb->memoryUsed());
+				}
+
+				decodedQueue.push({ raw.phaseNum, raw.index, pb });
+				const std::lock_guard<std::mutex> lock(state_mutex);
+				decoded[raw.phaseNum]++;
+				state_changed.notify_all();
 			}
+			if (--inflatersRunning == 0) decodedQueue.close();
+		});
+	}
+
+	std::vector<std::thread> workers;
+	for (unsigned int i = 0; i < threadNum; i++) {
+		workers.emplace_back([&]() {
+			DecodedBlock block;
+			while (decodedQueue.pop(block)) {
+				ReadPhase phase = all_phases[block.phaseNum];
+				{
+					std::unique_lock<std::mutex> lock(state_mutex);
+					state_changed.wait(lock, [&]() { return openPhase >= block.phaseNum; });
+				}
+
+				OsmLuaProcessing &output = acquireOutput(generate_output);
+				ReadBlock(*block.pb, output, std::make_pair(block.index, total_blocks), nodeKeys, locationsOnWays, usedNodesOnly, phase);
+				releaseOutput(output);
+
+				// Release the block once no phase needs it any more
+				bool finished;
+				{
+					const std::lock_guard<std::mutex> lock(block_mutex);
+					auto &info = blocks.at(block.index);
+					info.phases &= ~static_cast<unsigned int>(phase);
+					finished = (info.phases == 0);
+					if (finished) { blocks.erase(block.index); }
+				}
+				if (finished) cache.erase(block.index);
+
+				const std::lock_guard<std::mutex> lock(state_mutex);
+				processed[block.phaseNum]++;
+				state_changed.notify_all();
+			}
+		});
+	}
+
+	for (std::size_t phaseNum = 0; phaseNum < all_phases.size(); phaseNum++) {
+		{
+			std::unique_lock<std::mutex> lock(state_mutex);
+			openPhase = phaseNum;
+			state_changed.notify_all();
+			state_changed.wait(lock, [&]() { return dispatchDone[phaseNum] && processed[phaseNum] == dispatched[phaseNum]; });
 		}
-	
-		pool.join();
 
-		if(phase == ReadPhase::Nodes) {
-			osmStore.nodes_sort(threadNum);
+		if(all_phases[phaseNum] == ReadPhase::Nodes && !locationsOnWays) {
+			osmStore.nodes_sort(threadNum, sortedFile);
+			osmStore.clear_used_nodes();
 		}
-		if(phase == ReadPhase::Ways) {
-			osmStore.ways_sort(threadNum);
+		if(all_phases[phaseNum] == ReadPhase::RelationScan) {
+			osmStore.scanned_relations_sort(threadNum);
+		}
+		if(all_phases[phaseNum] == ReadPhase::Ways) {
+			osmStore.ways_sort(threadNum, sortedFile);
 		}
 	}
 
-	// ---- Sort the generated geometries
-	osmStore.generated_sort(threadNum);
+	reader.join();
+	for (auto &inflater : inflaters) inflater.join();
+	for (auto &worker : workers) worker.join();
+
 	osmStore.reportSize();
 
 	return 0;
 }
 
+// Touch each page of a block, so that it's read from disk by the reader rather than when it's inflated
+void PbfReader::pageIn(char const *data, std::size_t length)
+{
+	static const std::size_t pageSize = 4096;
+	volatile char sink = 0;
+	for (std::size_t i = 0; i < length; i += pageSize) { sink += data[i]; }
+	if (length > 0) { sink += data[length-1]; }
+}
+
 // Find a string in the dictionary
-int PbfReader::findStringPosition(PrimitiveBlock const &pb, char const *str) {
-	for (int i=0; i<pb.stringtable().s_size(); i++) {
-		if(pb.stringtable().s(i) == str)
-			return i;
+PbfReader::KeyFilter PbfReader::keyFilter(PbfPrimitiveBlock const &pb, unordered_set<string> const &keys) {
+	KeyFilter filter;
+	filter.active = !keys.empty();
+	for (auto const &key : keys) {
+		int position = findStringPosition(pb, key.c_str());
+		if (position >= 0) filter.positions.insert(position);
 	}
-	return -1;
+	return filter;
+}
+
+int PbfReader::findStringPosition(PbfPrimitiveBlock const &pb, char const *str) {
+	return pb.stringTable().find(str);
 }
 
 
@@ -13,10 +13,11 @@ ShpMemTiles::ShpMemTiles(OSMStore &osmStore, uint baseZoom)
 // - shapefile layer name to search
 // - bounding box to match against
 // - indexQuery(rtree, results) lambda, implements: rtree.query(geom::index::covered_by(box), back_inserter(results))
-// - checkQuery(osmstore, id) lambda, implements:   return geom::covered_by(osmStore.retrieve(id), geom)
+// - checkQuery(oo, mp) lambda, implements:   return geom::covered_by(geom, mp)
+// Only polygons are checked
 vector<uint> ShpMemTiles::QueryMatchingGeometries(const string &layerName, bool once, Box &box, 
 	function<vector<IndexValue>(const RTree &rtree)> indexQuery, 
-	function<bool(OutputObject const &oo)> checkQuery) const {
+	function<bool(OutputObject const &oo, MultiPolygon const &mp)> checkQuery) const {
 	
 	// Find the layer
 	auto f = indices.find(layerName); // f is an RTree
@@ -32,11 +33,35 @@ vector<uint> ShpMemTiles::QueryMatchingGeometries(const string &layerName, bool
 	vector<uint> ids;
 	for (auto it: results) {
 		uint id = it.second;
-		if (checkQuery(*cachedGeometries.at(id))) { ids.push_back(id); if (once) break; }
+		OutputObject const &oo = *cachedGeometries.at(id);
+		if (oo.geomType!=POLYGON_) continue;
+		if (checkQuery(oo, expandedPolygon(oo))) { ids.push_back(id); if (once) break; }
 	}
 	return ids;
 }
 
+// Polygons are stored packed, so they're expanded to test against. Nearby objects are
+// usually tested against the same few shapes, so each thread keeps its last few expanded
+// rather than keeping a second, expanded copy of every indexed polygon.
+MultiPolygon const &ShpMemTiles::expandedPolygon(OutputObject const &oo) const {
+	struct Expanded {
+		OSMStore::handle_t handle = nullptr;
+		MultiPolygon mp;
+	};
+	static const size_t cacheSize = 16;
+	static thread_local vector<Expanded> cache(cacheSize);
+	static thread_local size_t nextSlot = 0;
+
+	for (Expanded const &entry : cache) {
+		if (entry.handle == oo.handle) return entry.mp;
+	}
+	Expanded &entry = cache[nextSlot];
+	nextSlot = (nextSlot + 1) % cacheSize;
+	entry.handle = oo.handle;
+	entry.mp = osmStore.retrieve_multi_polygon(oo.handle);
+	return entry.mp;
+}
+
 vector<string> ShpMemTiles::namesOfGeometries(const vector<uint> &ids) const {
 	vector<string> names;
 	for (uint i=0; i<ids.size(); i++) {
@@ -74,9 +99,9 @@ OutputObjectRef ShpMemTiles::StoreShapefileGeometry(uint_least8_t layerNum,
 			if (p != nullptr) {
 	
 				Point sp(p->x()*10000000.0, p->y()*10000000.0);
-				osmStore.store_point(osmStore.shp(), id, sp);
+				OSMStore::handle_t handle = osmStore.store_point(osmStore.shp(), sp);
 				oo = CreateObject(OutputObjectOsmStorePoint(
-					geomType, layerNum, id, attributes, minzoom));
+					geomType, layerNum, id, handle, attributes, minzoom));
 				cachedGeometries.push_back(oo);
 
 				tilex =  lon2tilex(p->x(), baseZoom);
@@ -87,9 +112,9 @@ OutputObjectRef ShpMemTiles::StoreShapefileGeometry(uint_least8_t layerNum,
 
 		case LINESTRING_:
 		{
-			osmStore.store_linestring(osmStore.shp(), id, boost::get<Linestring>(geometry));
+			OSMStore::handle_t handle = osmStore.store_linestring(osmStore.shp(), boost::get<Linestring>(geometry));
 			oo = CreateObject(OutputObjectOsmStoreLinestring(
-						geomType, layerNum, id, attributes, minzoom));
+						geomType, layerNum, id, handle, attributes, minzoom));
 			cachedGeometries.push_back(oo);
 
 			addToTileIndexPolyline(oo, &geometry);
@@ -97,9 +122,9 @@ OutputObjectRef ShpMemTiles::StoreShapefileGeometry(uint_least8_t layerNum,
 
 		case POLYGON_:
 		{
-			osmStore.store_multi_polygon(osmStore.shp(), id, boost::get<MultiPolygon>(geometry));
+			OSMStore::handle_t handle = osmStore.store_multi_polygon(osmStore.shp(), boost::get<MultiPolygon>(geometry));
 			oo = CreateObject(OutputObjectOsmStoreMultiPolygon(
-						geomType, layerNum, id, attributes, minzoom));
+						geomType, layerNum, id, handle, attributes, minzoom));
 			cachedGeometries.push_back(oo);
 			
 			// add to tile index
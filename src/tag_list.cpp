@@ -0,0 +1,23 @@
+#include "tag_list.h"
+using namespace std;
+
+mutex TagKeys::mutex;
+unordered_map<string, uint32_t> TagKeys::ids;
+
+uint32_t TagKeys::intern(string const &key) {
+	lock_guard<std::mutex> lock(mutex);
+	auto it = ids.find(key);
+	if (it != ids.end()) return it->second;
+	uint32_t id = ids.size();
+	ids.emplace(key, id);
+	return id;
+}
+
+TagList::tag_map_t TagList::toMap() const {
+	tag_map_t map;
+	map.reserve(tags.size());
+	for (Tag const &tag : tags) {
+		map[tag.keyString.str()] = tag.value.str();
+	}
+	return map;
+}
@@ -296,12 +296,12 @@ bool outputProc(boost::asio::thread_pool &pool, SharedData &sharedData, OSMStore
 		ProcessLayer(osmStore, coordinates, zoom, data, tile, bbox, *lt, sharedData);
 	}
 
-	// Write to file or sqlite
-	string outputdata, compressed;
+	// Write to file or sqlite (reusing this thread's buffers from the previous tile)
+	static thread_local string outputdata, compressed;
 	if (sharedData.sqlite) {
 		// Write to sqlite
 		tile.SerializeToString(&outputdata);
-		if (sharedData.config.compress) { compressed = compress_string(outputdata, Z_DEFAULT_COMPRESSION, sharedData.config.gzip); }
+		if (sharedData.config.compress) { ZlibContext::forThread().compress(outputdata.data(), outputdata.size(), compressed, Z_DEFAULT_COMPRESSION, sharedData.config.gzip); }
 		sharedData.mbtiles.saveTile(zoom, bbox.index.x, bbox.index.y, sharedData.config.compress ? &compressed : &outputdata);
 
 	} else {
@@ -313,7 +313,8 @@ bool outputProc(boost::asio::thread_pool &pool, SharedData &sharedData, OSMStore
 		fstream outfile(filename.str(), ios::out | ios::trunc | ios::binary);
 		if (sharedData.config.compress) {
 			tile.SerializeToString(&outputdata);
-			outfile << compress_string(outputdata, Z_DEFAULT_COMPRESSION, sharedData.config.gzip);
+			ZlibContext::forThread().compress(outputdata.data(), outputdata.size(), compressed, Z_DEFAULT_COMPRESSION, sharedData.config.gzip);
+			outfile.write(compressed.data(), compressed.size());
 		} else {
 			if (!tile.SerializeToOstream(&outfile)) { cerr << "Couldn't write to " << filename.str() << endl; return false; }
 		}
@@ -52,7 +52,8 @@
 #include "shp_mem_tiles.h"
 
 #include <boost/asio/post.hpp>
-#include <boost/interprocess/streams/bufferstream.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 
 #ifndef TM_VERSION
 #define TM_VERSION (version not set)
@@ -167,9 +168,10 @@ int main(int argc, char* argv[]) {
 	string osmStoreFile;
 	string jsonFile;
 	uint threadNum;
+	uint blockCacheSize;
 	string outputFile;
 	string bbox;
-	bool _verbose = false, sqlite= false, mergeSqlite = false, mapsplit = false, osmStoreCompact = false, skipIntegrity = false;
+	bool _verbose = false, sqlite= false, mergeSqlite = false, mapsplit = false, osmStoreCompact = false, osmStoreSparse = false, osmStoreCompressed = false, onlyUsedNodes = false, skipIntegrity = false, hugePages = false, hugeTLB = false, noAccessHints = false;
 
 	po::options_description desc("tilemaker " STR(TM_VERSION) "\nConvert OpenStreetMap .pbf files into vector tiles\n\nAvailable options");
 	desc.add_options()
@@ -182,8 +184,15 @@ int main(int argc, char* argv[]) {
 		("process",po::value< string >(&luaFile)->default_value("process.lua"),  "tag-processing Lua file")
 		("store",  po::value< string >(&osmStoreFile),  "temporary storage for node/ways/relations data")
 		("compact",po::bool_switch(&osmStoreCompact),  "Reduce overall memory usage (compact mode).\nNOTE: This requires the input to be renumbered (osmium renumber)")
+		("sparse-nodes",po::bool_switch(&osmStoreSparse),                        "store nodes in pages indexed by ID (faster lookups, no renumbering needed)")
+		("compress-nodes",po::bool_switch(&osmStoreCompressed),                  "store nodes delta-compressed (less memory, slower lookups)")
+		("only-used-nodes",po::bool_switch(&onlyUsedNodes),                      "scan ways first, and only store the nodes they use")
+		("huge-pages",po::bool_switch(&hugePages),                               "ask for transparent huge pages for the in-memory store")
+		("hugetlb",po::bool_switch(&hugeTLB),                                    "map the in-memory store from the reserved huge page pool (vm.nr_hugepages)")
+		("no-access-hints",po::bool_switch(&noAccessHints),                      "don't tell the OS how --store files will be accessed")
 		("verbose",po::bool_switch(&_verbose),                                   "verbose error output")
 		("skip-integrity",po::bool_switch(&skipIntegrity),                       "don't enforce way/node integrity")
+		("block-cache",po::value< uint >(&blockCacheSize)->default_value(512),   "memory (MB) for decoded .pbf blocks kept between reading phases")
 		("threads",po::value< uint >(&threadNum)->default_value(0),              "number of threads (automatically detected if 0)");
 	po::positional_options_description p;
 	p.add("input", -1);
@@ -199,6 +208,7 @@ int main(int argc, char* argv[]) {
 	if (vm.count("help")) { cout << desc << endl; return 0; }
 	if (vm.count("output")==0) { cerr << "You must specify an output file or directory. Run with --help to find out more." << endl; return -1; }
 	if (vm.count("input")==0) { cout << "No source .osm.pbf file supplied" << endl; }
+	if (osmStoreCompact + osmStoreSparse + osmStoreCompressed > 1) { cerr << "Only one of --compact, --sparse-nodes and --compress-nodes can be used" << endl; return -1; }
 
 	vector<string> bboxElements = parseBox(bbox);
 
@@ -284,8 +294,13 @@ int main(int argc, char* argv[]) {
 
 	// For each tile, objects to be used in processing
 	OSMStore osmStore;
-	osmStore.use_compact_store(osmStoreCompact);
+	if (osmStoreCompact) osmStore.use_node_store(OSMStore::NodeStoreType::Compact);
+	else if (osmStoreSparse) osmStore.use_node_store(OSMStore::NodeStoreType::Sparse);
+	else if (osmStoreCompressed) osmStore.use_node_store(OSMStore::NodeStoreType::Compressed);
 	osmStore.enforce_integrity(!skipIntegrity);
+	if (hugeTLB) void_mmap_allocator::usePages(void_mmap_allocator::PageMode::HugeTLB);
+	else if (hugePages) void_mmap_allocator::usePages(void_mmap_allocator::PageMode::Transparent);
+	void_mmap_allocator::useAccessHints(!noAccessHints);
 	if(!osmStoreFile.empty()) {
 		std::cout << "Using osm store file: " << osmStoreFile << std::endl;
 		osmStore.open(osmStoreFile);
@@ -320,35 +335,52 @@ int main(int argc, char* argv[]) {
 		}
 	}
 	
-	// ---- Sort the generated shapes
-	osmStore.shapes_sort(threadNum);
-
 	// ----	Read significant node tags
 
 	vector<string> nodeKeyVec = osmLuaProcessing.GetSignificantNodeKeys();
 	unordered_set<string> nodeKeys(nodeKeyVec.begin(), nodeKeyVec.end());
+	vector<string> wayKeyVec = osmLuaProcessing.GetSignificantWayKeys();
+	vector<string> relationKeyVec = osmLuaProcessing.GetSignificantRelationKeys();
 
 	// ----	Read all PBFs
 	
 	PbfReader pbfReader(osmStore);
+	pbfReader.setBlockCacheSize(static_cast<std::size_t>(blockCacheSize) * 1000000);
+	pbfReader.setOnlyUsedNodes(onlyUsedNodes);
+	pbfReader.setWayKeys(unordered_set<string>(wayKeyVec.begin(), wayKeyVec.end()));
+	pbfReader.setRelationKeys(unordered_set<string>(relationKeyVec.begin(), relationKeyVec.end()));
 	std::vector<bool> sortOrders = layers.getSortOrders();
 
 	if (!mapsplit) {
 		for (auto inputFile : inputFiles) {
 			cout << "Reading .pbf " << inputFile << endl;
-			ifstream infile(inputFile, ios::in | ios::binary);
-			if (!infile) { cerr << "Couldn't open .pbf file " << inputFile << endl; return -1; }
+
+			// Map the whole file so blocks can be parsed straight from it
+			boost::interprocess::file_mapping pbfMapping;
+			boost::interprocess::mapped_region pbfRegion;
+			try {
+				pbfMapping = boost::interprocess::file_mapping(inputFile.c_str(), boost::interprocess::read_only);
+				pbfRegion = boost::interprocess::mapped_region(pbfMapping, boost::interprocess::read_only);
+			} catch (boost::interprocess::interprocess_exception &e) {
+				cerr << "Couldn't open .pbf file " << inputFile << ": " << e.what() << endl;
+				return -1;
+			}
 			
+			// Reuse the block index from an earlier run, or write one for next time
+			PbfBlockIndex blockIndex;
+			blockIndex.load(inputFile);
+
 			int ret = pbfReader.ReadPbfFile(nodeKeys, threadNum, 
-				[&]() { 
-					return std::make_unique<ifstream>(inputFile, ios::in | ios::binary);
-				},
+				static_cast<char const *>(pbfRegion.get_address()), pbfRegion.get_size(), &blockIndex,
 				[&]() {
 					return std::make_unique<OsmLuaProcessing>(osmStore, config, layers, luaFile, shpMemTiles, osmMemTiles, attributeStore);
 				});	
 			if (ret != 0) return ret;
+			if (!blockIndex.loaded && !blockIndex.save(inputFile)) {
+				cout << "Couldn't write block index " << PbfBlockIndex::indexFile(inputFile) << endl;
+			}
 		} 
-		void_mmap_allocator::shutdown(); // this clears the mmap'ed nodes/ways/relations (quickly!)
+		pbfReader.ClearOutputs();
 	}
 
 	// ----	Initialise SharedData
@@ -419,18 +451,19 @@ int main(int argc, char* argv[]) {
 			}
 
 			cout << "Reading tile " << srcZ << ": " << srcX << "," << srcY << " (" << (run+1) << "/" << runs << ")" << endl;
-			vector<char> pbf = mapsplitFile.readTile(srcZ,srcX,tmsY);
-
-			int ret = pbfReader.ReadPbfFile(nodeKeys, 1, 
-				[&]() { 
-					return make_unique<boost::interprocess::bufferstream>(pbf.data(), pbf.size(),  ios::in | ios::binary);
-				},
-				[&]() {
-					return std::make_unique<OsmLuaProcessing>(osmStore, config, layers, luaFile, shpMemTiles, osmMemTiles, attributeStore);
-				});	
+			// The tile is read where sqlite holds it, so it's only valid until readTile returns
+			int ret = 0;
+			mapsplitFile.readTile(srcZ,srcX,tmsY, [&](char const *pbf, std::size_t size) {
+				ret = pbfReader.ReadPbfFile(nodeKeys, 1, 
+					pbf, size, nullptr,
+					[&]() {
+						return std::make_unique<OsmLuaProcessing>(osmStore, config, layers, luaFile, shpMemTiles, osmMemTiles, attributeStore);
+					});	
+			});
 			if (ret != 0) return ret;
 
 			tileList.pop_back();
+			if (tileList.empty()) pbfReader.ClearOutputs();
 		}
 
 		// Launch the pool with threadNum threads